@@ -0,0 +1,34 @@
+#version 330 core
+
+// input
+in vec2 world_pos;
+
+// output
+out vec4 frag_color;
+
+// uniforms
+uniform vec2 camera_pos;
+uniform float parallax;
+uniform float depth;
+
+// cache of the layer being drawn, and its size in tiles. The cache
+// wraps around, so that tile (x, y) is at (x, y) mod cache_size.
+uniform sampler2D cache;
+uniform vec2 cache_size;
+
+void main()
+{
+        vec2 pos;
+
+        // world_pos is as seen by layers scrolling with the camera.
+        pos = world_pos - camera_pos * (1 - parallax);
+
+        frag_color = texture(cache, pos / cache_size);
+
+        // Like for the other shaders, transparent pixels must not hide
+        // what is drawn behind them later through the depth buffer.
+        if (frag_color.a < 0.5)
+                discard;
+
+        gl_FragDepth = depth;
+}
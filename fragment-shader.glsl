@@ -13,4 +13,9 @@ uniform sampler2D texture0;
 void main()
 {
         frag_color = texture(texture0, texture_coords);
+
+        // Transparent pixels must not hide what is drawn behind them
+        // later through the depth buffer.
+        if (frag_color.a < 0.5)
+                discard;
 }
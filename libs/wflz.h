@@ -0,0 +1,258 @@
+/* wflz - single-header LZ compressor and decompressor
+
+   Do this:
+      #define WFLZ_IMPLEMENTATION
+   before you include this file in *one* C file to create the
+   implementation.
+
+   Compressed data uses the LZ4 block format: a series of sequences,
+   each made of a token byte, whose high nibble is the number of
+   literals and low nibble the match length minus 4 (15 meaning more
+   length bytes follow, each added to it until one is not 255), the
+   literals, and a 16-bit little-endian match offset back into the
+   output. The last sequence has only literals. Like LZ4, the
+   compressor leaves the last 5 bytes as literals and starts no match
+   in the last 12 bytes, so its output can be read by any LZ4 block
+   decoder.
+
+   The compressor is a greedy single-probe hash matcher, favoring speed
+   over ratio; the decompressor checks all its input, so corrupt data
+   is reported rather than read or written out of bounds.
+
+     int wflz_compress_bound(int size);
+
+       Largest compressed size of size bytes of input.
+
+     int wflz_compress(const void *src, int src_size,
+                       void *dst, int dst_capacity);
+
+       Compresses src into dst, returning the compressed size, or 0 if
+       it does not fit in dst_capacity bytes.
+
+     int wflz_decompress(const void *src, int src_size,
+                         void *dst, int dst_size);
+
+       Decompresses src into dst, returning the decompressed size, or -1
+       if the data is corrupt or decompresses to more than dst_size
+       bytes. */
+
+#ifndef WFLZ_H
+#define WFLZ_H
+
+int wflz_compress_bound(int size);
+int wflz_compress(const void *src, int src_size, void *dst, int dst_capacity);
+int wflz_decompress(const void *src, int src_size, void *dst, int dst_size);
+
+#endif /* WFLZ_H */
+
+#ifdef WFLZ_IMPLEMENTATION
+
+#include <stdint.h>
+#include <string.h>
+
+#define WFLZ_MIN_MATCH 4
+#define WFLZ_LAST_LITERALS 5
+#define WFLZ_MATCH_LIMIT 12
+#define WFLZ_MAX_OFFSET 65535
+#define WFLZ_HASH_BITS 12
+
+static uint32_t
+wflz__read32(const unsigned char *p)
+{
+        uint32_t value;
+
+        memcpy(&value, p, 4);
+        return value;
+}
+
+static unsigned int
+wflz__hash(uint32_t value)
+{
+        return (value * 2654435761u) >> (32 - WFLZ_HASH_BITS);
+}
+
+static unsigned char *
+wflz__put_length(unsigned char *op, size_t length)
+{
+        while (length >= 255) {
+                *op++ = 255;
+                length -= 255;
+        }
+        *op++ = length;
+
+        return op;
+}
+
+/* Writes a sequence of the given literals followed by a match, or only
+   the literals if match_length is 0. Returns the end of the output, or
+   NULL if it does not fit. */
+static unsigned char *
+wflz__put_sequence(unsigned char *op, unsigned char *oend,
+                   const unsigned char *literals, size_t literal_count,
+                   size_t offset, size_t match_length)
+{
+        size_t extra = match_length ? match_length - WFLZ_MIN_MATCH : 0;
+        unsigned char *token = op;
+
+        if ((size_t) (oend - op) < 1 + literal_count / 255 + 1 +
+            literal_count + 2 + extra / 255 + 1)
+                return NULL;
+
+        ++op;
+        *token = (literal_count < 15 ? literal_count : 15) << 4;
+        if (literal_count >= 15)
+                op = wflz__put_length(op, literal_count - 15);
+        memcpy(op, literals, literal_count);
+        op += literal_count;
+
+        if (!match_length)
+                return op;
+
+        *op++ = offset;
+        *op++ = offset >> 8;
+        *token |= extra < 15 ? extra : 15;
+        if (extra >= 15)
+                op = wflz__put_length(op, extra - 15);
+
+        return op;
+}
+
+int
+wflz_compress_bound(int size)
+{
+        return size + size / 255 + 16;
+}
+
+int
+wflz_compress(const void *src, int src_size, void *dst, int dst_capacity)
+{
+        const unsigned char *in = src;
+        const unsigned char *ip = in;
+        const unsigned char *anchor = in;
+        const unsigned char *end = in + src_size;
+        const unsigned char *match;
+        unsigned char *op = dst;
+        unsigned char *oend = op + dst_capacity;
+        int table[1 << WFLZ_HASH_BITS];
+        unsigned int h;
+        int reference;
+        uint32_t sequence;
+        size_t length;
+
+        for (int i = 0; i < 1 << WFLZ_HASH_BITS; ++i)
+                table[i] = -1;
+
+        if (src_size > WFLZ_MATCH_LIMIT) {
+                while (ip < end - WFLZ_MATCH_LIMIT) {
+                        sequence = wflz__read32(ip);
+                        h = wflz__hash(sequence);
+                        reference = table[h];
+                        table[h] = ip - in;
+
+                        if (reference < 0 ||
+                            ip - in - reference > WFLZ_MAX_OFFSET ||
+                            wflz__read32(in + reference) != sequence) {
+                                ++ip;
+                                continue;
+                        }
+                        match = in + reference;
+
+                        length = WFLZ_MIN_MATCH;
+                        while (ip + length < end - WFLZ_LAST_LITERALS &&
+                               ip[length] == match[length])
+                                ++length;
+
+                        op = wflz__put_sequence(op, oend, anchor, ip - anchor,
+                                                ip - match, length);
+                        if (!op)
+                                return 0;
+
+                        ip += length;
+                        anchor = ip;
+                }
+        }
+
+        op = wflz__put_sequence(op, oend, anchor, end - anchor, 0, 0);
+        if (!op)
+                return 0;
+
+        return op - (unsigned char *) dst;
+}
+
+/* Reads the rest of a length whose nibble was 15, or returns 0 if the
+   input ends first. */
+static int
+wflz__get_length(const unsigned char **ip, const unsigned char *iend,
+                 size_t *length)
+{
+        unsigned char byte;
+
+        do {
+                if (*ip == iend)
+                        return 0;
+                byte = *(*ip)++;
+                *length += byte;
+        } while (byte == 255);
+
+        return 1;
+}
+
+int
+wflz_decompress(const void *src, int src_size, void *dst, int dst_size)
+{
+        const unsigned char *ip = src;
+        const unsigned char *iend = ip + src_size;
+        unsigned char *out = dst;
+        unsigned char *op = out;
+        unsigned char *oend = op + dst_size;
+        const unsigned char *match;
+        unsigned char token;
+        size_t length, offset;
+
+        while (ip < iend) {
+                token = *ip++;
+
+                length = token >> 4;
+                if (length == 15 && !wflz__get_length(&ip, iend, &length))
+                        return -1;
+                if (length > (size_t) (iend - ip) ||
+                    length > (size_t) (oend - op))
+                        return -1;
+                memcpy(op, ip, length);
+                op += length;
+                ip += length;
+
+                /* The last sequence has no match. */
+                if (ip == iend)
+                        break;
+
+                if (iend - ip < 2)
+                        return -1;
+                offset = ip[0] | ip[1] << 8;
+                ip += 2;
+                if (offset == 0 || offset > (size_t) (op - out))
+                        return -1;
+
+                length = token & 15;
+                if (length == 15 && !wflz__get_length(&ip, iend, &length))
+                        return -1;
+                length += WFLZ_MIN_MATCH;
+                if (length > (size_t) (oend - op))
+                        return -1;
+
+                match = op - offset;
+                if (offset >= length) {
+                        memcpy(op, match, length);
+                        op += length;
+                } else {
+                        /* Overlapping matches repeat the last offset
+                           bytes. */
+                        while (length--)
+                                *op++ = *match++;
+                }
+        }
+
+        return op - out;
+}
+
+#endif /* WFLZ_IMPLEMENTATION */
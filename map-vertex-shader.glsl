@@ -4,26 +4,68 @@
 in int index;
 
 // instance attributes
-in vec4 tile_texture_coords;
+in uint tile;
 
 // output
 out vec4 coords;
 out vec2 texture_coords;
 
 // uniforms
-uniform int map_width;
+uniform ivec2 chunk_origin;
+uniform ivec2 chunk_size;
 uniform vec2 camera_pos;
 uniform vec2 camera_size;
+uniform float layer_parallax[8];
+uniform float layer_depth[8];
+
+// texture coordinates of each sprite in the sheet, indexed by sprite
+uniform samplerBuffer tile_table;
+
+// frame count, frame duration (milliseconds) and sprite stride between
+// frames of each sprite, indexed by sprite, and the current time in
+// milliseconds
+uniform usamplerBuffer tile_anims;
+uniform uint time;
+
+const uint TILE_SPRITE_BITS = 13u;
+const uint TILE_NONE = (1u << TILE_SPRITE_BITS) - 1u;
 
 void main()
 {
-        vec2 tile;
+        vec2 tile_pos;
         vec2 pos;
+        vec4 tile_texture_coords;
+        int i;
+        uint layer;
+        uint sprite;
+        uvec4 anim;
+
+        // The top bits of the tile are the layer it belongs to, the
+        // rest the sprite index.
+        layer = tile >> TILE_SPRITE_BITS;
+        sprite = tile & TILE_NONE;
+
+        if (sprite == TILE_NONE) {
+                // Empty tile; all vertices at the same position so
+                // that nothing is drawn.
+                coords = vec4(0.0, 0.0, 0.0, 1.0);
+                gl_Position = coords;
+                texture_coords = vec2(0.0, 0.0);
+                return;
+        }
+
+        // One instance is run for each tile of each layer of the chunk
+        // being drawn, the layers one after the other, so we get the
+        // tile position based on the instance ID.
+        i = gl_InstanceID % (chunk_size.x * chunk_size.y);
+        tile_pos = vec2(chunk_origin +
+                        ivec2(i % chunk_size.x, i / chunk_size.x));
+
+        // Animated sprites show the sprite of the current frame.
+        anim = texelFetch(tile_anims, int(sprite));
+        sprite += (time / anim.y) % anim.x * anim.z;
 
-        // One instance is run for each tile, so we get the tile
-        // position based on the instance ID.
-        tile = vec2(gl_InstanceID % map_width,
-                    gl_InstanceID / map_width);
+        tile_texture_coords = texelFetch(tile_table, int(sprite));
 
         // "index" determines which tile vertex we have.
         //
@@ -34,31 +76,31 @@ void main()
         // background to occasionally bleed through.
         switch (index) {
         case 0: // bottom-left
-                pos = tile;
+                pos = tile_pos;
                 texture_coords = tile_texture_coords.xy + vec2(0.001, 0.001);
                 break;
         case 1: // top-left
-                pos = tile + vec2(0, 1);
+                pos = tile_pos + vec2(0, 1);
                 texture_coords = tile_texture_coords.xw + vec2(0.001, -0.001);
                 break;
         case 2: // top-right
-                pos = tile + vec2(1, 1);
+                pos = tile_pos + vec2(1, 1);
                 texture_coords = tile_texture_coords.zw + vec2(-0.001, -0.001);
                 break;
         case 3: // bottom-right
-                pos = tile + vec2(1, -0);
+                pos = tile_pos + vec2(1, -0);
                 texture_coords = tile_texture_coords.zy + vec2(-0.001, 0.001);
                 break;
         }
 
-        // camera transform
-        pos = 2 * (pos - camera_pos) / camera_size;
+        // camera transform; each layer scrolls at its own rate.
+        pos = 2 * (pos - camera_pos * layer_parallax[layer]) / camera_size;
 
         // position is now from zero upwards. translate to (-1, -1) so
         // that the origin is at the bottom-left corner of the
         // viewport, not at the center.
         pos -= vec2(1, 1);
 
-        coords = vec4(pos, 0.0, 1.0);
+        coords = vec4(pos, 2 * layer_depth[layer] - 1, 1.0);
         gl_Position = coords;
 }
@@ -0,0 +1,24 @@
+#version 330 core
+
+// input
+in vec4 coords;
+in vec2 texture_coords;
+in vec4 tint;
+
+// output
+out vec4 frag_color;
+
+// uniforms
+uniform sampler2D texture0;
+uniform bool translucent;
+
+void main()
+{
+        frag_color = texture(texture0, texture_coords) * tint;
+
+        // Transparent pixels must not hide what is drawn behind them
+        // later through the depth buffer. Translucent sprites are drawn
+        // last without writing depth, and blended instead.
+        if (frag_color.a < 0.5 && !translucent)
+                discard;
+}
@@ -5,40 +5,96 @@ in int index;
 
 // instance attributes
 in vec2 obj_position;
-in vec2 obj_size;
-in vec4 obj_texture_coords;
+in uint obj_sprite;
+in uvec2 obj_bits; // flags, tint
+in uint obj_clip_start;
 
 // output
 out vec4 coords;
 out vec2 texture_coords;
+out vec4 tint;
 
 // uniforms
 uniform vec2 camera_pos;
 uniform vec2 camera_size;
+uniform float max_y;
+uniform samplerBuffer sprites;
+uniform vec4 tints[16];
+
+// first sprite, frame count, frame duration (milliseconds) and mode of
+// each clip, and the current time in milliseconds
+uniform usamplerBuffer clips;
+uniform uint time;
+
+// object flags
+const uint FLIP_X = 1u;
+const uint FLIP_Y = 2u;
+const uint ANIMATED = 4u;
+
+// clip modes
+const uint CLIP_ONCE = 1u;
+const uint CLIP_PING_PONG = 2u;
 
 void main()
 {
         vec2 pos;
+        uint sprite = obj_sprite;
+        uvec4 clip;
+        uint frame, period;
+
+        // Animated objects have a clip instead of a sprite.
+        if ((obj_bits.x & ANIMATED) != 0u) {
+                clip = texelFetch(clips, int(obj_sprite));
+                frame = (time - obj_clip_start) / clip.z;
+                if (clip.w == CLIP_ONCE) {
+                        frame = min(frame, clip.y - 1u);
+                } else if (clip.w == CLIP_PING_PONG && clip.y > 1u) {
+                        period = 2u * clip.y - 2u;
+                        frame %= period;
+                        if (frame >= clip.y)
+                                frame = period - frame;
+                } else {
+                        frame %= clip.y;
+                }
+                sprite = clip.x + frame;
+        }
+
+        // Each sprite is two texels in the table: its texture
+        // rectangle, then its size and base.
+        vec4 rect = texelFetch(sprites, 2 * int(sprite));
+        vec4 shape = texelFetch(sprites, 2 * int(sprite) + 1);
+        vec2 obj_size = shape.xy;
+
+        if ((obj_bits.x & FLIP_X) != 0u)
+                rect.xz = rect.zx;
+        if ((obj_bits.x & FLIP_Y) != 0u)
+                rect.yw = rect.wy;
+
+        // Keep the texture coordinates slightly inside the rectangle,
+        // whichever way it is flipped.
+        vec2 inset = 0.001 * sign(rect.zw - rect.xy);
 
         switch (index) {
         case 0: // bottom-left
                 pos = obj_position;
-                texture_coords = obj_texture_coords.xy + vec2(0.001, 0.001);
+                texture_coords = rect.xy + inset;
                 break;
         case 1: // top-left
                 pos = obj_position + vec2(0, obj_size.y);
-                texture_coords = obj_texture_coords.xw + vec2(0.001, -0.001);
+                texture_coords = rect.xw + vec2(inset.x, -inset.y);
                 break;
         case 2: // top-right
                 pos = obj_position + obj_size;
-                texture_coords = obj_texture_coords.zw + vec2(-0.001, -0.001);
+                texture_coords = rect.zw - inset;
                 break;
         case 3: // bottom-right
                 pos = obj_position + vec2(obj_size.x, 0);
-                texture_coords = obj_texture_coords.zy + vec2(-0.001, 0.001);
+                texture_coords = rect.zy + vec2(-inset.x, inset.y);
                 break;
         }
 
+        tint = tints[obj_bits.y];
+
         // camera transform
         pos = 2 * (pos - camera_pos) / camera_size;
 
@@ -47,6 +103,12 @@ void main()
         // viewport, not at the center.
         pos -= vec2(1, 1);
 
-        coords = vec4(pos, 0.0, 1.0);
+        // Objects are at depths from 0.75 at the top of the map down
+        // to 0.25 at the bottom (z from 0.5 to -0.5), between the map
+        // layers below and above the objects, so that the ones lower
+        // down are in front.
+        float base = obj_position.y + shape.z * obj_size.y;
+        float z = clamp(base / max_y, 0.0, 1.0) - 0.5;
+        coords = vec4(pos, z, 1.0);
         gl_Position = coords;
 }
@@ -0,0 +1,33 @@
+#version 330 core
+
+// input
+in vec2 world_pos;
+
+// output
+out vec4 frag_color;
+
+// uniforms
+uniform vec2 map_size;
+uniform float depth;
+
+// average color of each tile of the map, with premultiplied alpha
+uniform sampler2D overview;
+
+void main()
+{
+        vec4 color;
+
+        if (any(lessThan(world_pos, vec2(0))) ||
+            any(greaterThanEqual(world_pos, map_size)))
+                discard;
+
+        color = texture(overview, world_pos / map_size);
+        if (color.a == 0.0)
+                discard;
+
+        frag_color = vec4(color.rgb / color.a, color.a);
+
+        // The overview blends all the layers, and is kept behind the
+        // objects like the layers below them.
+        gl_FragDepth = depth;
+}
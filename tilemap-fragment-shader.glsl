@@ -0,0 +1,106 @@
+#version 330 core
+
+// input
+in vec2 world_pos;
+
+// output
+out vec4 frag_color;
+
+// uniforms
+uniform sampler2D texture0;
+uniform samplerBuffer tile_table;
+uniform ivec2 map_size;
+uniform int chunk_size;
+uniform vec2 camera_pos;
+uniform float layer_parallax[8];
+uniform ivec2 layer_range;
+uniform float depth;
+
+// frame count, frame duration (milliseconds) and sprite stride between
+// frames of each sprite, indexed by sprite, and the current time in
+// milliseconds
+uniform usamplerBuffer tile_anims;
+uniform uint time;
+
+// atlas of the chunks in memory, one array layer per map layer, and
+// the slot plus one of every chunk in the atlas (zero for chunks not in
+// memory)
+uniform usampler2DArray map_tiles;
+uniform usampler2D chunk_slots;
+uniform int atlas_columns;
+
+const uint TILE_SPRITE_MASK = (1u << 13u) - 1u;
+const uint TILE_NONE = TILE_SPRITE_MASK;
+
+vec4 sample_layer(int layer)
+{
+        vec2 pos;
+        ivec2 tile_pos;
+        ivec2 atlas_pos;
+        vec4 tile_texture_coords;
+        vec2 tile_size;
+        vec2 texture_coords;
+        int slot;
+        uint sprite;
+        uvec4 anim;
+
+        // world_pos is as seen by layers scrolling with the camera.
+        pos = world_pos - camera_pos * (1 - layer_parallax[layer]);
+        tile_pos = ivec2(floor(pos));
+
+        if (any(lessThan(tile_pos, ivec2(0))) ||
+            any(greaterThanEqual(tile_pos, map_size)))
+                return vec4(0.0);
+
+        slot = int(texelFetch(chunk_slots, tile_pos / chunk_size, 0).r) - 1;
+        if (slot < 0)
+                return vec4(0.0);
+
+        atlas_pos = ivec2(slot % atlas_columns, slot / atlas_columns) *
+                chunk_size + tile_pos % chunk_size;
+        sprite = texelFetch(map_tiles, ivec3(atlas_pos, layer), 0).r &
+                TILE_SPRITE_MASK;
+        if (sprite == TILE_NONE)
+                return vec4(0.0);
+
+        // Animated sprites show the sprite of the current frame.
+        anim = texelFetch(tile_anims, int(sprite));
+        sprite += (time / anim.y) % anim.x * anim.z;
+
+        tile_texture_coords = texelFetch(tile_table, int(sprite));
+        tile_size = tile_texture_coords.zw - tile_texture_coords.xy;
+
+        // Position inside the sprite. Like the instanced map shader,
+        // keep a small distance from the sprite borders so that
+        // neighbouring sprites in the sheet do not bleed through.
+        texture_coords = tile_texture_coords.xy +
+                clamp(fract(pos), 0.001, 0.999) * tile_size;
+
+        // Derivatives are taken from the continuous map position,
+        // otherwise the jump in texture coordinates at the tile
+        // borders would select the wrong mipmap level there.
+        return textureGrad(texture0, texture_coords,
+                           dFdx(pos) * tile_size,
+                           dFdy(pos) * tile_size);
+}
+
+void main()
+{
+        vec4 color = vec4(0.0);
+        vec4 layer_color;
+
+        // Blend the layers in range from back to front.
+        for (int layer = layer_range.x; layer <= layer_range.y; ++layer) {
+                layer_color = sample_layer(layer);
+                color = layer_color * layer_color.a +
+                        color * (1.0 - layer_color.a);
+        }
+
+        // Like for the other shaders, transparent pixels must not hide
+        // what is drawn behind them later through the depth buffer.
+        if (color.a < 0.5)
+                discard;
+
+        frag_color = color;
+        gl_FragDepth = depth;
+}
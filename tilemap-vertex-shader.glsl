@@ -0,0 +1,39 @@
+#version 330 core
+
+// vertex attributes
+in int index;
+
+// output
+out vec2 world_pos;
+
+// uniforms
+uniform vec2 camera_pos;
+uniform vec2 camera_size;
+
+void main()
+{
+        vec2 pos;
+
+        // A single quad covering the whole viewport is drawn. "index"
+        // determines which corner of the viewport we have.
+        switch (index) {
+        case 0: // bottom-left
+                pos = vec2(-1, -1);
+                break;
+        case 1: // top-left
+                pos = vec2(-1, 1);
+                break;
+        case 2: // top-right
+                pos = vec2(1, 1);
+                break;
+        case 3: // bottom-right
+                pos = vec2(1, -1);
+                break;
+        }
+
+        // inverse camera transform, so that the fragment shader
+        // receives map coordinates.
+        world_pos = camera_pos + (pos + vec2(1, 1)) * camera_size / 2;
+
+        gl_Position = vec4(pos, 0.0, 1.0);
+}
@@ -1,19 +1,52 @@
 #include <glad/glad.h>
 #include <SDL2/SDL.h>
+#include <fcntl.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#include <math.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wfmap.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
+#define WFLZ_IMPLEMENTATION
+#include <wflz.h>
+
 static GLuint texture;
+static int texture_w;
+static int texture_h;
+static GLuint tile_table_buffer;
+static GLuint tile_table_texture;
+static int tile_count;
+static GLuint tile_anim_buffer;
+static GLuint tile_anim_texture;
 static GLuint object_program;
 static GLuint map_program;
+static GLuint cache_program;
+static GLuint overview_program;
 static GLuint object_vbo;
 static GLuint object_instance_vbo;
 static GLuint object_vao;
 static GLuint map_vbo;
 static GLuint map_instance_vbo;
 static GLuint map_vao;
+static GLuint cache_vao;
+static GLuint overview_vao;
+static GLuint map_texture;
+static GLint map_tile_attr;
+static GLint map_chunk_origin_uniform;
+static GLint map_chunk_size_uniform;
+static GLint map_layer_range_uniform;
+static GLint map_depth_uniform;
+static GLint map_time_uniform;
 
 static float cam_x = 0.0;
 static float cam_y = 0.0;
@@ -21,68 +54,674 @@ static float cam_w = 1.0;
 static float cam_h = 1.0;
 static float zoom = 1.0;
 
+/* Size of the viewport in pixels. */
+static int view_w;
+static int view_h;
+
+/* Frame time statistics are printed every STATS_INTERVAL seconds when
+   enabled from the command line. */
+#define STATS_INTERVAL 5
+static int show_stats = 0;
+
 const int UNIT_SIZE = 16;
 const int MAP_WIDTH = 200;
 const int MAP_HEIGHT = 100;
 
-static int obj_count = 3;
-struct object {
-        float x;
-        float y;
-        float base_y;
+/* Map tiles are stored as 16 bits: the index of the layer the tile
+   belongs to in the top TILE_LAYER_BITS bits, and the index of its
+   sprite in the sprite sheet in the rest. The sheet is a grid of
+   UNIT_SIZE x UNIT_SIZE sprites, numbered row by row starting from the
+   top-left one. TILE_NONE marks empty tiles. */
+typedef uint16_t tile_t;
+
+#define TILE_LAYER_BITS WFMAP_TILE_LAYER_BITS
+#define TILE_SPRITE_BITS (16 - TILE_LAYER_BITS)
+#define TILE_SPRITE_MASK ((1 << TILE_SPRITE_BITS) - 1)
+#define TILE_NONE TILE_SPRITE_MASK
+#define MAKE_TILE(layer, sprite) ((tile_t) ((layer) << TILE_SPRITE_BITS | (sprite)))
+#define TILE_SPRITE(tile) ((tile) & TILE_SPRITE_MASK)
+
+#define TILE_GROUND 0
+
+/* Sprites can be animated: tiles using an animated sprite show frame
+   number (time / duration) % frames instead, which is the sprite at
+   sprite + frame * stride. The animation of every sprite is kept in a
+   table on the GPU and the frame is chosen in the shaders, so animated
+   tiles cost nothing on the CPU. */
+struct tile_anim {
+        GLushort frames;
+        GLushort duration; /* milliseconds */
+        GLushort stride;
+        GLushort unused;
+};
+
+/* Terrains are drawn with autotile sets: runs of consecutive sprites
+   in the sheet, one for each combination of the neighbors of a tile
+   being of the same terrain or not. The terrain of a tile is the set
+   its sprite belongs to, so only sprites are stored in the map.
+
+   Sets depending on the 4 edge neighbors have 16 sprites, indexed by
+   the neighbor mask below. Sets depending on all 8 neighbors only care
+   about a corner neighbor if both edge neighbors next to it are of the
+   same terrain, which leaves 47 combinations; the sprites are in order
+   of increasing mask. Tiles outside the map or in chunks not in memory
+   count as being of the same terrain. */
+#define MAX_AUTOTILES 32
+
+#define NEIGHBOR_N 1
+#define NEIGHBOR_E 2
+#define NEIGHBOR_S 4
+#define NEIGHBOR_W 8
+#define NEIGHBOR_NE 16
+#define NEIGHBOR_SE 32
+#define NEIGHBOR_SW 64
+#define NEIGHBOR_NW 128
+
+struct autotile {
+        int base;      /* first sprite of the set */
+        int neighbors; /* 4 or 8 */
+};
+
+static struct autotile autotiles[MAX_AUTOTILES];
+static int autotile_count;
+static signed char *sprite_terrain; /* autotile set of each sprite, or -1 */
+static unsigned char blob_variants[256];
+
+/* The map consists of up to MAX_LAYERS layers of tiles, drawn on top
+   of each other. Each layer scrolls at its own rate relative to the
+   camera (1.0 being the rate of the objects) and is either drawn below
+   or above the objects. Depth testing keeps the layers in order, so
+   all layers of a chunk can be drawn at once. The depth range is
+   divided into three bands: layers below the objects, objects, and
+   layers above the objects, from back to front. */
+#define MAX_LAYERS (1 << TILE_LAYER_BITS)
+#define LAYER_ABOVE_OBJECTS WFMAP_LAYER_ABOVE_OBJECTS
+#define LAYER_ANIMATED WFMAP_LAYER_ANIMATED /* not cached in cached map mode */
+
+#define DEPTH_BELOW_OBJECTS 0.75f
+#define DEPTH_OBJECTS 0.5f
+#define DEPTH_ABOVE_OBJECTS 0.25f
+
+struct layer {
+        float parallax;
+        int flags;
+};
+
+static struct layer layers[MAX_LAYERS];
+static int map_layers;
+
+/* The map can be drawn in one of three ways: either one instance per
+   tile for each visible chunk, or as a single quad covering the screen
+   with the tiles looked up from a texture in the fragment shader. The
+   former costs per tile while the latter costs per pixel. The cached
+   mode draws layers the first way into off-screen textures, and then
+   only the parts of them that scroll into view or are edited. */
+static enum {
+        MAP_MODE_INSTANCED,
+        MAP_MODE_TEXTURE,
+        MAP_MODE_CACHED,
+} map_mode = MAP_MODE_INSTANCED;
+
+/* Size of the map in tiles. This is read from the world file, or
+   defaults to MAP_WIDTH x MAP_HEIGHT for generated worlds. */
+static int map_width;
+static int map_height;
+
+/* The map is split into square chunks of CHUNK_SIZE x CHUNK_SIZE
+   tiles. Chunks are loaded on a background thread as the camera
+   approaches them, and only as many of them as fit in the chunk memory
+   cap are kept around; the least recently used ones are evicted to
+   make room for new ones.
+
+   Each chunk in memory is also assigned a slot in the GPU-side map
+   storage (a range of instances in the map instance buffer, or a
+   region of the map texture) so that only the visible chunks need to
+   be drawn. Chunks on the right and top edges of the map might be
+   smaller if the map size is not a multiple of the chunk size. */
+#define CHUNK_SIZE 32
+#define CHUNK_TILES (CHUNK_SIZE * CHUNK_SIZE)
+
+/* Number of chunks kept loaded around the camera rectangle, and
+   additionally in the direction the player is moving. */
+#define CHUNK_MARGIN 1
+#define CHUNK_PREFETCH 3
+
+/* When more than one in this many tiles of a chunk are edited in one
+   frame, the whole chunk is uploaded again instead of the edited
+   ranges. */
+#define CHUNK_REUPLOAD_FRACTION 4
+
+/* Edited ranges of tiles closer than this are uploaded together, since
+   a few extra bytes are cheaper than another buffer update call. */
+#define DIRTY_MERGE_GAP 8
+
+/* Time in milliseconds after which the player is not considered to be
+   moving anymore. */
+#define PREFETCH_TIMEOUT 500
+
+#define DEFAULT_CHUNK_MEMORY 16 /* megabytes */
+
+enum chunk_state {
+        CHUNK_FREE,
+        CHUNK_QUEUED,   /* waiting to be picked up by the loader */
+        CHUNK_LOADING,  /* tiles being filled by the loader */
+        CHUNK_LOADED,   /* tiles ready, waiting to be uploaded */
+        CHUNK_RESIDENT, /* uploaded and ready to be drawn */
+};
+
+struct chunk {
+        int cx; /* chunk coordinates */
+        int cy;
+        int width;
+        int height;
+        int slot;
+        enum chunk_state state;
+        unsigned int last_wanted; /* frame number */
+        unsigned int last_drawn;  /* frame number */
+
+        /* Chunks edited with set_tile() are never evicted, so that
+           the edits are not lost. Tiles edited since the last upload
+           are marked in the dirty bitmap. */
+        int modified;
+        int dirty_count;
+        Uint64 *dirty;
+
+        struct chunk *hash_next;
+        struct chunk *lru_prev;
+        struct chunk *lru_next;
+
+        /* Tiles of each layer one after the other, each layer row by
+           row, width * height tiles per layer. These are either in the
+           world map or in the chunk's own buffer, which has room for
+           CHUNK_TILES tiles per layer. */
+        tile_t *tiles;
+        tile_t *buffer;
+};
+
+static int chunk_memory = DEFAULT_CHUNK_MEMORY;
+static struct chunk *chunk_pool;
+static int chunk_pool_size;
+static struct chunk *free_chunks;
+static struct chunk **chunk_hash;
+static int chunk_hash_size;
+static int chunks_w;
+static int chunks_h;
+static unsigned int frame_number;
+
+/* Chunks in memory are kept in a list ordered from most recently
+   wanted (head) to least recently wanted (tail). */
+static struct chunk *lru_head;
+static struct chunk *lru_tail;
+
+/* Chunks with tiles edited since the last frame. */
+static struct chunk **dirty_chunks;
+static int dirty_chunks_len;
+
+/* The main thread appends chunks to load_queue; the loader thread
+   takes them in order, fills in their tiles and appends them to
+   loaded_queue for the main thread to upload. The queues and the state
+   of queued and loading chunks are protected by loader_mutex. The
+   tiles of a chunk are only touched by the loader while the chunk is
+   in CHUNK_LOADING state. */
+static SDL_Thread *loader_thread;
+static SDL_mutex *loader_mutex;
+static SDL_cond *loader_cond;
+static struct chunk **load_queue;
+static int load_queue_len;
+static struct chunk **loaded_queue;
+static struct chunk **upload_list;
+static int loaded_queue_len;
+static int loader_quit;
+
+/* World files are in the .wfmap format (see wfmap.h). The file is
+   mapped in memory privately, and the tiles of chunks in memory point
+   straight into the mapping, so that loading a chunk only costs the
+   page faults for it, taken on the loader thread, and uploading it is
+   copying from the mapping to the GPU. Tile edits get private copies of
+   the pages they touch. Compressed chunks are decompressed into the
+   chunk's buffer on the loader thread instead. Without a world file,
+   chunks are generated. */
+static const char *world_filename;
+static unsigned char *world_map;
+static size_t world_map_size;
+static const unsigned char *world_directory;
+
+/* Map texture mode: chunks are stored in an atlas texture, one array
+   layer per map layer, and a second texture maps each chunk of the map
+   to its slot in the atlas. */
+static GLuint chunk_slots_texture;
+static int atlas_columns;
+
+/* Map cached mode: each layer not flagged as animated is drawn into a
+   texture covering the camera rectangle as seen by the layer, and from
+   there to the screen. The texture wraps around in both directions:
+   tile (x, y) is always drawn at (x mod cache_tiles_w, y mod
+   cache_tiles_h), so when the camera moves only the rows and columns
+   of tiles coming into view need to be drawn. The rectangle of tiles
+   currently in the texture, and a rectangle of tiles to draw again
+   (edited or newly loaded), are kept for each layer. Rectangles are
+   in tiles, the end coordinates exclusive. */
+struct layer_cache {
+        GLuint texture;
+        GLuint fbo;
+        int x0, y0, x1, y1;
+        int dirty_x0, dirty_y0, dirty_x1, dirty_y1;
+};
+
+static struct layer_cache layer_caches[MAX_LAYERS];
+static int cache_tiles_w;
+static int cache_tiles_h;
+static int cache_pixels_w;
+static int cache_pixels_h;
+static float cache_cam_w; /* camera size the caches were made for */
+static float cache_cam_h;
+static GLint cache_size_uniform;
+static GLint cache_parallax_uniform;
+static GLint cache_depth_uniform;
+
+/* When zoomed out so far that a tile is drawn smaller than
+   LOD_TILE_PIXELS pixels, the map is drawn from an overview texture
+   instead, one texel per tile and mipmapped, holding the average color
+   of each tile. This costs the same however much of the map is in
+   view, and no chunks need to be loaded for it. The overview is built
+   from the whole world on its own thread when the world is opened,
+   and kept up to date with the chunks edited since. Sprite colors are
+   the average of their texels, with premultiplied alpha, and so are
+   the overview texels. */
+#define LOD_TILE_PIXELS 2
+
+static unsigned char (*sprite_colors)[4];
+static GLuint overview_texture;
+static SDL_Thread *overview_thread;
+static unsigned char *overview_pixels; /* protected by loader_mutex */
+static int overview_ready;
+static int overview_mips_dirty;
+
+/* Work that can be split up, like going over all the objects, is run
+   as jobs on a pool of threads, one for each core counting the main
+   thread. Each thread that runs jobs has a queue of them, which it
+   pushes to and takes from at the bottom; idle threads steal jobs from
+   the top of the others' queues. Threads outside the pool, like the
+   overview thread, push to the queues of the other pool threads in
+   turn, leaving the main thread's alone unless it is the only one. A
+   job can depend on others, and is only queued once they are done.
+   parallel_for() is the usual way in: it splits a range into jobs and
+   waits for them all.
+
+   Waiting threads run jobs from their own queue while they wait, but
+   do not steal, so that the main thread is not held up running the
+   long jobs of background threads. Jobs are normally on the stack of
+   the thread submitting them and waiting for them; nothing may touch
+   a job once it is marked done. */
+#define MAX_JOB_THREADS 64
+#define JOB_QUEUE_SIZE 256
+#define MAX_JOB_DEPENDENTS 4
+#define MAX_PARALLEL_JOBS 128
+
+/* Ranges are split into this many jobs per thread, for the threads
+   done early to have some left to steal. */
+#define JOB_SPLIT 4
+
+typedef void (*job_func)(void *data, int start, int end);
+
+struct job {
+        job_func func;           /* NULL for jobs only waiting for others */
+        void *data;
+        int start;
+        int end;
+        SDL_atomic_t waiting;    /* unfinished dependencies, plus one until
+                                    submitted */
+        SDL_atomic_t done;
+        SDL_SpinLock lock;       /* protects the rest */
+        int closed;              /* finished, takes no more dependents */
+        struct job *dependents[MAX_JOB_DEPENDENTS];
+        int dependent_count;
+};
+
+/* Jobs are pushed and popped at bottom, and stolen at top. */
+struct job_queue {
+        SDL_SpinLock lock;
+        unsigned int top;
+        unsigned int bottom;
+        struct job *jobs[JOB_QUEUE_SIZE];
+} __attribute__((aligned(64)));
+
+static int job_thread_count; /* including the main thread */
+static SDL_Thread *job_threads[MAX_JOB_THREADS];
+static struct job_queue job_queues[MAX_JOB_THREADS];
+static SDL_sem *jobs_queued; /* posted for every job queued */
+static SDL_atomic_t jobs_quit;
+static SDL_atomic_t next_job_queue; /* for threads without a queue */
+static _Thread_local int own_job_queue = -1;
+
+/* Objects are stored as a structure of arrays, one array per field,
+   so that code working on a few fields of every object, like moving
+   them or filling in the instance buffer, only touches those and can
+   handle several objects at once with SIMD instructions. The arrays
+   grow geometrically as objects are spawned, and stay packed:
+   despawning an object moves the last one into its place.
+
+   Since objects move around in the arrays, they are referred to by
+   handles, which stay valid for as long as the object lives. A handle
+   names a slot in obj_slots, which holds the index of the object, and
+   the generation of the slot. The generation is bumped whenever the
+   object in the slot is despawned, so that stale handles are told
+   apart from those of later objects reusing the slot. */
+enum object_type {
+        PLAYER,
+        OTHER,
+};
+
+/* Object flags. Translucent objects are blended over what is behind
+   them, rather than only having their transparent pixels cut out.
+   The flip flags mirror the sprite, and are passed on to the shader
+   in the low byte of the flags. */
+#define OBJ_FLIP_X 1
+#define OBJ_FLIP_Y 2
+#define OBJ_ANIMATED 4 /* only in instance records, see below */
+#define OBJ_TRANSLUCENT 0x100
+
+/* Objects are drawn with sprites from a table, which is also available
+   to the object shader. Sizes are in tiles, and the base is where the
+   object touches the ground, as a fraction of its height. */
+struct object_sprite {
         float width;
         float height;
+        float base_y;
         float texture_s;
         float texture_t;
         float texture_width;
         float texture_height;
-
-        enum {
-                PLAYER,
-                OTHER,
-        } type;
 };
 
-static struct object objects[] = {
+static const struct object_sprite object_sprites[] = {
         {
-                .x = 0.0f,
-                .y = 0.0f,
-                .base_y = 0.0f,
                 .width = 5.0f,
                 .height = 5.0f,
+                .base_y = 0.0f,
                 .texture_s = 0.0f,
                 .texture_t = 0.5f,
                 .texture_width = 0.5f,
                 .texture_height = 0.5f,
-                .type = OTHER,
         },
         {
-                .x = 20.0f,
-                .y = 15.0f,
-                .base_y = 0.0f,
                 .width = 10.0f,
                 .height = 10.0f,
+                .base_y = 0.0f,
                 .texture_s = 0.5f,
                 .texture_t = 0.5f,
                 .texture_width = 0.5f,
                 .texture_height = 0.5f,
-                .type = PLAYER,
         },
         {
-                .x = 17.0f,
-                .y = 12.0f,
-                .base_y = 0.1875f,
                 .width = 10.0f,
                 .height = 10.0f,
+                .base_y = 0.1875f,
                 .texture_s = 0.5f,
                 .texture_t = 0.0f,
                 .texture_width = 0.5f,
                 .texture_height = 0.5,
+        },
+};
+
+/* Objects can play animation clips: runs of consecutive sprites in the
+   table, each shown for duration milliseconds, either looping, once
+   (stopping at the last frame), or back and forth. Like tile
+   animations, the clips are kept in a table on the GPU and the object
+   shader picks the frame from the time the object started playing the
+   clip, so animated objects cost nothing on the CPU. Sorting and
+   culling only know the first frame, so the frames of a clip should
+   have about the same size and base. Clip 0 is no clip. */
+enum clip_mode {
+        CLIP_LOOP,
+        CLIP_ONCE,
+        CLIP_PING_PONG,
+};
+
+struct object_clip {
+        int sprite;   /* first frame */
+        int frames;
+        int duration; /* of each frame, in milliseconds */
+        enum clip_mode mode;
+};
+
+static const struct object_clip object_clips[] = {
+        { 0 },
+        {
+                .sprite = 1,
+                .frames = 2,
+                .duration = 250,
+                .mode = CLIP_LOOP,
+        },
+};
+
+/* Objects can be tinted with one of these colors, which the sprite is
+   multiplied by. The first one leaves it as is. The object shader has
+   room for 16. */
+static const float object_tints[][4] = {
+        { 1.0f, 1.0f, 1.0f, 1.0f },
+        { 1.0f, 0.5f, 0.5f, 1.0f },
+        { 0.5f, 1.0f, 0.5f, 1.0f },
+        { 0.5f, 0.5f, 1.0f, 1.0f },
+        { 1.0f, 1.0f, 1.0f, 0.5f },
+};
+
+typedef Uint32 object_handle;
+
+#define OBJ_HANDLE_SLOT_BITS 22
+#define OBJ_HANDLE_SLOT_MASK ((1 << OBJ_HANDLE_SLOT_BITS) - 1)
+#define OBJ_GENERATION_MASK ((1 << (32 - OBJ_HANDLE_SLOT_BITS)) - 1)
+#define MAX_OBJECTS (1 << OBJ_HANDLE_SLOT_BITS)
+
+/* Description of an object to spawn. */
+struct object {
+        float x;
+        float y;
+        float vx; /* velocity, in tiles per second */
+        float vy;
+        int sprite;
+        int clip;     /* if not 0, played from spawning on */
+        int tint;
+        enum object_type type;
+        int flags;
+};
+
+/* The size and base of the sprite are copied into the arrays of each
+   object, for code working on them and the positions together. */
+static struct {
+        float *x;
+        float *y;
+        float *vx;
+        float *vy;
+        float *base_y;
+        float *width;
+        float *height;
+        int *sprite;
+        int *clip;
+        Uint32 *clip_start; /* in SDL_GetTicks() time */
+        int *tint;
+        int *type;
+        int *flags;
+        object_handle *handle;
+        Uint32 *changed;   /* upload serial of the last change */
+        int *grid_cell;    /* -1 if not in the grid */
+        int *grid_next;
+        int *grid_prev;
+} objects;
+
+struct obj_slot {
+        int index;         /* of the object, or of the next free slot */
+        Uint32 generation;
+};
+
+/* Alignment of the arrays in bytes, for SIMD loads and stores. */
+#define OBJ_ALIGN 32
+
+static int obj_count;
+static int obj_capacity;
+static struct obj_slot *obj_slots;
+static int obj_slot_count;
+static int obj_free_slot = -1;
+static int objects_dirty;
+static int objects_moving;
+static int have_avx;
+
+/* To find the objects in some area without going through all of them,
+   they are also kept in a uniform grid over the map, of cells
+   OBJ_GRID_CELL tiles on a side. Each object is in the cell its
+   bottom-left corner is over, clamped to the grid, in a doubly linked
+   list threaded through objects.grid_next and objects.grid_prev, and
+   touch_object() moves it to another cell when needed. Since objects
+   reach up and to the right of their cell, queries also look at the
+   cells as far down and to the left as the largest sprite is wide and
+   high. */
+#define OBJ_GRID_CELL 8
+
+static int *obj_grid; /* first object in each cell, or -1 */
+static int obj_grid_w;
+static int obj_grid_h;
+static float obj_grid_reach_x;
+static float obj_grid_reach_y;
+
+/* The objects drawn in the order of the last sort, followed by the
+   ones that were out of view, in their order from before, and the ones
+   spawned since. Despawned objects are left in until the next sort. */
+static object_handle *obj_order;
+static int obj_order_count;
+static int obj_sorted_count; /* objects drawn after the last sort */
+
+/* Only the objects in view are sorted, uploaded and drawn. Before each
+   sort, obj_visible[i] is set to all ones if object i overlaps the
+   camera rectangle, and to 0 if not. */
+static Uint32 *obj_visible;
+
+/* Only the instance records that changed are uploaded. Uploads are
+   numbered, and each object and each position in the drawing order
+   remembers the number of the upload that first has its latest
+   change: objects.changed, bumped by touch_object(), and
+   obj_order_changed, bumped by the sort when an object takes a new
+   position. A region of the ring then needs the records changed after
+   the upload last written to it. When the sort moved more than
+   1 / OBJ_REORDER_FULL_UPLOAD of the objects, the whole region is
+   rewritten instead of looking for them. */
+#define OBJ_REORDER_FULL_UPLOAD 4
+
+static Uint32 *obj_order_changed;
+static Uint32 obj_upload_serial;
+static int obj_reordered;
+static Uint64 obj_upload_bytes; /* since the last stats report */
+
+/* Objects are drawn in two passes: first the opaque ones, then the
+   translucent ones. Each object is drawn at a depth given by its base,
+   so the depth buffer puts opaque objects in front of or behind each
+   other in any order. By default they are sorted anyway. In the depth
+   object order they are not, and only the translucent ones are,
+   since blending needs them drawn back to front. */
+static enum {
+        OBJECT_ORDER_SORT,
+        OBJECT_ORDER_DEPTH,
+} object_order = OBJECT_ORDER_SORT;
+
+/* Objects are sorted by their base, quantized to 1 / SORT_KEY_SCALE
+   tiles, as (key, index) pairs: obj_sort_keys[i] is the key of object
+   obj_draw_order[i]. The spare arrays are for the radix sort passes.
+   The objects are packed into the instance buffer in the drawing
+   order, without moving them in their arrays: the obj_opaque_count
+   opaque objects first, then the translucent ones. */
+#define SORT_KEY_SCALE 256
+#define SORT_KEY_MAX 0xffffffff
+
+static Uint32 *obj_sort_keys;
+static int *obj_draw_order;
+static Uint32 *obj_sort_keys_spare;
+static int *obj_draw_order_spare;
+static int obj_opaque_count;
+
+/* Instance record of an object. Everything else the shader needs is
+   looked up from the sprite and clip tables. Positions are kept in
+   full, since neither half floats nor 16-bit fixed point would place
+   objects to a pixel across a large world. Objects playing a clip have
+   OBJ_ANIMATED in their flags and the clip instead of the sprite. */
+struct obj_instance {
+        float x;
+        float y;
+        Uint16 sprite;
+        Uint8 flags;
+        Uint8 tint;
+        Uint32 clip_start;
+};
+
+/* Objects in the instance buffer, and room for how many there is. */
+static int obj_draw_count;
+static int obj_instance_capacity;
+
+/* The instance buffer is a ring of OBJ_RING_REGIONS regions, each with
+   room for obj_instance_capacity objects. Every upload goes to the next
+   region, once the fence set after the last draw from it has
+   signaled; with a few frames in flight that has normally happened
+   long before. When ARB_buffer_storage is there, the buffer is mapped
+   once, persistently, at obj_ring_data. Otherwise each region is
+   mapped unsynchronized as it is written, the fences doing the
+   synchronizing. */
+#define OBJ_RING_REGIONS 3
+
+static GLsync obj_ring_fences[OBJ_RING_REGIONS];
+static Uint32 obj_ring_serials[OBJ_RING_REGIONS]; /* 0 if never written */
+static int obj_ring_region;
+static GLintptr obj_ring_offset; /* of the region last written */
+static struct obj_instance *obj_ring_data;
+static GLint obj_position_attr;
+static GLint obj_sprite_attr;
+static GLint obj_bits_attr;
+static GLint obj_clip_start_attr;
+static GLint obj_translucent_uniform;
+static GLint obj_time_uniform;
+static GLuint obj_sprite_buffer;
+static GLuint obj_sprite_texture;
+static GLuint obj_clip_buffer;
+static GLuint obj_clip_texture;
+
+/* ARB_buffer_storage, which is not part of OpenGL 3.3. */
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+
+typedef void (APIENTRYP PFN_glBufferStorage)(GLenum target,
+                                             GLsizeiptr size,
+                                             const void *data,
+                                             GLbitfield flags);
+static PFN_glBufferStorage buffer_storage;
+
+/* Extra objects scattered over the map, set from the command line. */
+static int crowd_size;
+
+/* Threads to run jobs on, set from the command line; 0 for one per
+   core. */
+static int thread_count;
+
+static const struct object initial_objects[] = {
+        {
+                .x = 0.0f,
+                .y = 0.0f,
+                .sprite = 0,
+                .type = OTHER,
+        },
+        {
+                .x = 20.0f,
+                .y = 15.0f,
+                .sprite = 1,
+                .type = PLAYER,
+        },
+        {
+                .x = 17.0f,
+                .y = 12.0f,
+                .sprite = 2,
                 .type = OTHER,
         }
 };
 
-struct object *player = &objects[1];
+static object_handle player;
 
 static char *
 read_file(const char *filename, long *length)
@@ -185,23 +824,29 @@ load_shader_program(const char *vertex_shader_filename,
 static void
 update_camera(void)
 {
+        GLuint programs[] = {
+                object_program,
+                map_program,
+                cache_program,
+                overview_program,
+        };
         GLint camera_pos, camera_size;
 
-        camera_pos = glGetUniformLocation(object_program, "camera_pos");
-        camera_size = glGetUniformLocation(object_program, "camera_size");
+        for (int i = 0; i < sizeof(programs) / sizeof(programs[0]); ++i) {
+                if (!programs[i])
+                        continue;
 
-        glUseProgram(object_program);
-        glUniform2f(camera_pos, cam_x, cam_y);
-        glUniform2f(camera_size, cam_w * zoom, cam_h * zoom);
-        glUseProgram(0);
+                camera_pos = glGetUniformLocation(programs[i], "camera_pos");
+                camera_size = glGetUniformLocation(programs[i], "camera_size");
 
-        camera_pos = glGetUniformLocation(map_program, "camera_pos");
-        camera_size = glGetUniformLocation(map_program, "camera_size");
+                glUseProgram(programs[i]);
+                glUniform2f(camera_pos, cam_x, cam_y);
+                glUniform2f(camera_size, cam_w * zoom, cam_h * zoom);
+                glUseProgram(0);
+        }
 
-        glUseProgram(map_program);
-        glUniform2f(camera_pos, cam_x, cam_y);
-        glUniform2f(camera_size, cam_w * zoom, cam_h * zoom);
-        glUseProgram(0);
+        /* Other objects may be in view now. */
+        objects_dirty = 1;
 }
 
 static void
@@ -218,19 +863,19 @@ center_camera(float x, float y)
                 cam_y = 0;
         }
 
-        if (cam_x + cam_w >= MAP_WIDTH) {
-                cam_x = MAP_WIDTH - cam_w;
+        if (cam_x + cam_w >= map_width) {
+                cam_x = map_width - cam_w;
         }
 
-        if (cam_y + cam_h >= MAP_HEIGHT) {
-                cam_y = MAP_HEIGHT - cam_h;
+        if (cam_y + cam_h >= map_height) {
+                cam_y = map_height - cam_h;
         }
 
         update_camera();
 }
 
 static GLuint
-load_texture(const char *filename)
+load_texture(const char *filename, int *width, int *height)
 {
         GLuint tex;
         int w, h, channels;
@@ -263,6 +908,9 @@ load_texture(const char *filename)
         printf("Loaded texture: filename=%s size=%dx%d channels=%d\n",
                filename, w, h, channels);
 
+        *width = w;
+        *height = h;
+
         glTexParameteri(GL_TEXTURE_2D,
                         GL_TEXTURE_WRAP_S,
                         GL_CLAMP_TO_EDGE);
@@ -284,251 +932,3242 @@ load_texture(const char *filename)
         return tex;
 }
 
-static float
-obj_base_y(const struct object *obj)
+static void
+init_job(struct job *job, job_func func, void *data, int start, int end)
 {
-        return obj->y + obj->base_y * obj->height;
+        job->func = func;
+        job->data = data;
+        job->start = start;
+        job->end = end;
+        SDL_AtomicSet(&job->waiting, 1);
+        SDL_AtomicSet(&job->done, 0);
+        job->lock = 0;
+        job->closed = 0;
+        job->dependent_count = 0;
 }
 
+/* Make a job that has not been submitted yet wait for another to be
+   done. */
 static void
-sort_objects(void)
+job_depends_on(struct job *job, struct job *dependency)
 {
-        int i, j;
-        struct object key;
+        SDL_AtomicLock(&dependency->lock);
+        if (!dependency->closed) {
+                if (dependency->dependent_count == MAX_JOB_DEPENDENTS) {
+                        printf("Too many jobs depending on one job.\n");
+                        exit(1);
+                }
+                dependency->dependents[dependency->dependent_count++] = job;
+                SDL_AtomicIncRef(&job->waiting);
+        }
+        SDL_AtomicUnlock(&dependency->lock);
+}
 
-        /* Use insertion sort to sort the objects. This is an
-           efficient algorithm when the array is already mostly
-           sorted, which is the case here. */
-        for (i = 0; i < obj_count; ++i) {
-                key = objects[i];
+static void run_job(struct job *job);
 
-                j = i - 1;
-                while (j >= 0 &&
-                       obj_base_y(&objects[j]) < obj_base_y(&key))
-                {
-                        objects[j + 1] = objects[j];
-                        --j;
-                }
+/* Queue a job with no more dependencies to wait for. */
+static void
+push_job(struct job *job)
+{
+        struct job_queue *queue;
+        int index = own_job_queue;
 
-                objects[j + 1] = key;
+        /* There is no point in queuing jobs with nothing to do. */
+        if (!job->func) {
+                run_job(job);
+                return;
         }
 
-        /* Find the player object in the list and store a pointer to
-           it. */
-        for (i = 0; i < obj_count; ++i) {
-                if (objects[i].type == PLAYER) {
-                        player = &objects[i];
-                        break;
-                }
+        if (index < 0 && job_thread_count == 1)
+                index = 0;
+        else if (index < 0)
+                index = 1 + (unsigned int) SDL_AtomicAdd(&next_job_queue, 1) %
+                        (job_thread_count - 1);
+        queue = &job_queues[index];
+
+        SDL_AtomicLock(&queue->lock);
+        if (queue->bottom - queue->top == JOB_QUEUE_SIZE) {
+                SDL_AtomicUnlock(&queue->lock);
+                run_job(job);
+                return;
         }
+        queue->jobs[queue->bottom++ % JOB_QUEUE_SIZE] = job;
+        SDL_AtomicUnlock(&queue->lock);
+
+        SDL_SemPost(jobs_queued);
 }
 
-static void
-update_object_data(void)
+/* Take the job at the bottom of a queue, or NULL if it is empty. */
+static struct job *
+pop_job(struct job_queue *queue)
 {
-        sort_objects();
+        struct job *job = NULL;
 
-        glBindBuffer(GL_ARRAY_BUFFER, object_instance_vbo);
+        SDL_AtomicLock(&queue->lock);
+        if (queue->bottom != queue->top)
+                job = queue->jobs[--queue->bottom % JOB_QUEUE_SIZE];
+        SDL_AtomicUnlock(&queue->lock);
 
-        /* Re-allocate buffer data. In case data size has changed this
-           is necessary so we allocate enough data. If data size has
-           not changed, this is still useful since it effectively
-           invalidate the previous buffer (like glInvalidateBufferData
-           would do), and the call to glMapBuffer would not block even
-           if the buffer is currently in use by GPU.
+        return job;
+}
 
-           At least, that's my understanding so far. Don't quote me on
-           this!
-        */
-        glBufferData(GL_ARRAY_BUFFER,
-                     obj_count * 8 * sizeof(GLfloat),
-                     NULL,
-                     GL_DYNAMIC_DRAW);
+/* Take the job at the top of a queue, or NULL if it is empty. */
+static struct job *
+steal_job(struct job_queue *queue)
+{
+        struct job *job = NULL;
+
+        SDL_AtomicLock(&queue->lock);
+        if (queue->bottom != queue->top)
+                job = queue->jobs[queue->top++ % JOB_QUEUE_SIZE];
+        SDL_AtomicUnlock(&queue->lock);
+
+        return job;
+}
+
+/* A job from the thread's own queue if there is one, or else stolen
+   from another. */
+static struct job *
+find_job(void)
+{
+        int own = own_job_queue;
+        struct job *job;
+
+        if (own >= 0 && (job = pop_job(&job_queues[own])))
+                return job;
 
-        float *data = glMapBuffer(GL_ARRAY_BUFFER, GL_WRITE_ONLY);
-        for (int i = 0; i < obj_count; ++i) {
-                float *base = data + 8 * i;
-                base[0] = objects[i].x;
-                base[1] = objects[i].y;
-                base[2] = objects[i].width;
-                base[3] = objects[i].height;
-                base[4] = objects[i].texture_s;
-                base[5] = objects[i].texture_t;
-                base[6] = objects[i].texture_s + objects[i].texture_width;
-                base[7] = objects[i].texture_t + objects[i].texture_height;
+        for (int i = 1; i <= job_thread_count; ++i) {
+                job = steal_job(&job_queues[(own + i) % job_thread_count]);
+                if (job)
+                        return job;
         }
-        glUnmapBuffer(GL_ARRAY_BUFFER);
 
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        return NULL;
 }
 
 static void
-init_objects(void)
+run_job(struct job *job)
 {
-        object_program = load_shader_program("obj-vertex-shader.glsl",
-                                             "fragment-shader.glsl");
-
-        /* Vertex data are actually only the vertex indices. 0, 1, 2,
-           and 3 being the bottom-left, top-left, top-right and
-           bottom-right corners of the quad. */
-        int vertex_data[] = {
-                0, 1, 3, /* triangle 1 */
-                1, 2, 3, /* triangle 2 */
-        };
+        struct job *dependents[MAX_JOB_DEPENDENTS];
+        int count;
 
-        glGenVertexArrays(1, &object_vao);
-        glGenBuffers(1, &object_vbo);
-        glGenBuffers(1, &object_instance_vbo);
+        if (job->func)
+                job->func(job->data, job->start, job->end);
 
-        glBindVertexArray(object_vao);
+        SDL_AtomicLock(&job->lock);
+        job->closed = 1;
+        count = job->dependent_count;
+        memcpy(dependents, job->dependents, count * sizeof(struct job *));
+        SDL_AtomicUnlock(&job->lock);
 
-        glBindBuffer(GL_ARRAY_BUFFER, object_vbo);
-        glBufferData(GL_ARRAY_BUFFER,
-                     sizeof(vertex_data),
-                     vertex_data,
-                     GL_STATIC_DRAW);
+        SDL_AtomicSet(&job->done, 1);
 
-        GLint index_attr = glGetAttribLocation(object_program, "index");
-        glVertexAttribIPointer(index_attr, 1, GL_INT, 1 * sizeof(int),
-                               (void *) 0);
-        glEnableVertexAttribArray(index_attr);
+        for (int i = 0; i < count; ++i)
+                if (SDL_AtomicDecRef(&dependents[i]->waiting))
+                        push_job(dependents[i]);
+}
 
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+/* Queue a job once its dependencies are done. */
+static void
+submit_job(struct job *job)
+{
+        if (SDL_AtomicDecRef(&job->waiting))
+                push_job(job);
+}
 
-        update_object_data();
+/* Wait for a submitted job to be done, running others meanwhile. */
+static void
+wait_job(struct job *job)
+{
+        struct job *other;
 
-        glBindBuffer(GL_ARRAY_BUFFER, object_instance_vbo);
+        while (!SDL_AtomicGet(&job->done)) {
+                other = own_job_queue >= 0 ?
+                        pop_job(&job_queues[own_job_queue]) : find_job();
+                if (other)
+                        run_job(other);
+                else
+                        SDL_Delay(0);
+        }
+}
 
-        GLint obj_position_attr = glGetAttribLocation(object_program,
-                                                      "obj_position");
-        glEnableVertexAttribArray(obj_position_attr);
-        glVertexAttribPointer(obj_position_attr, 2, GL_FLOAT, GL_FALSE,
-                              8 * sizeof(float), (void *) 0);
-        glVertexAttribDivisor(obj_position_attr, 1);
+static int
+job_thread_main(void *data)
+{
+        struct job *job;
 
-        GLint obj_size_attr = glGetAttribLocation(object_program, "obj_size");
-        glEnableVertexAttribArray(obj_size_attr);
-        glVertexAttribPointer(obj_size_attr, 2, GL_FLOAT, GL_FALSE,
-                              8 * sizeof(float),
-                              (void *) (2 * sizeof(GLfloat)));
-        glVertexAttribDivisor(obj_size_attr, 1);
-
-        GLint obj_tex_coords_attr = glGetAttribLocation(object_program, "obj_texture_coords");
-        glEnableVertexAttribArray(obj_tex_coords_attr);
-        glVertexAttribPointer(obj_tex_coords_attr, 4, GL_FLOAT, GL_FALSE,
-                              8 * sizeof(float), (void *) (4 * sizeof(GLfloat)));
-        glVertexAttribDivisor(obj_tex_coords_attr, 1);
-
-        /* glVertexAttribPointer already registered with the VAO, so
-         * we can safely unbind */
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        own_job_queue = (int) (intptr_t) data;
 
-        /* Unbind VAO */
-        glBindVertexArray(0);
+        for (;;) {
+                SDL_SemWait(jobs_queued);
+                if (SDL_AtomicGet(&jobs_quit))
+                        break;
 
-        int max_y_uniform = glGetUniformLocation(object_program,
-                                                 "max_y");
+                /* Some other thread may have taken the job posted for. */
+                job = find_job();
+                if (job)
+                        run_job(job);
+        }
 
-        glUseProgram(object_program);
-        glUniform1f(max_y_uniform, MAP_HEIGHT);
-        glUseProgram(0);
+        return 0;
 }
 
+/* Run func on [0, count), split into ranges of a multiple of grain
+   items run in parallel. The results should not depend on how it was
+   split, as that changes with the number of threads. */
 static void
-init_map(void)
+parallel_for(int count, int grain, job_func func, void *data)
 {
-        map_program = load_shader_program("map-vertex-shader.glsl",
-                                          "fragment-shader.glsl");
-
-        /* Vertex data are actually only the vertex indices. 0, 1, 2,
-           and 3 being the bottom-left, top-left, top-right and
-           bottom-right corners of the quad. */
-        int vertex_data[] = {
-                0, 1, 3, /* triangle 1 */
-                1, 2, 3, /* triangle 2 */
-        };
+        struct job jobs[MAX_PARALLEL_JOBS];
+        struct job all;
+        int parts = job_thread_count * JOB_SPLIT;
+        int size, n;
 
-        int map_size = MAP_WIDTH * MAP_HEIGHT;
-        float *instance_data = malloc(map_size * 4 * sizeof(GLfloat));
-        float *base;
-        for (int y = 0; y < MAP_HEIGHT; ++y) {
-                for (int x = 0; x < MAP_WIDTH; ++x) {
-                        /* Each instance attribute is a vec4
-                           consisting of two texture coordinates. */
+        if (parts > MAX_PARALLEL_JOBS)
+                parts = MAX_PARALLEL_JOBS;
 
-                        /* bottom-left texture coordinates */
-                        base = instance_data + 4*((MAP_WIDTH * y) + x);
-                        base[0] = 0.0f;
-                        base[1] = 0.5;
+        size = (count + parts - 1) / parts;
+        size = (size + grain - 1) / grain * grain;
+        if (size == 0 || size >= count) {
+                if (count > 0)
+                        func(data, 0, count);
+                return;
+        }
+        n = (count + size - 1) / size;
 
-                        /* top-right texture-coordinates */
-                        base[2] = 0.5f;
-                        base[3] = 1.0f;
-                }
+        init_job(&all, NULL, NULL, 0, 0);
+        for (int i = 0; i < n; ++i) {
+                init_job(&jobs[i], func, data, i * size,
+                         i == n - 1 ? count : (i + 1) * size);
+                job_depends_on(&all, &jobs[i]);
         }
 
-        glGenVertexArrays(1, &map_vao);
-        glGenBuffers(1, &map_vbo);
-        glGenBuffers(1, &map_instance_vbo);
+        submit_job(&all);
+        for (int i = n - 1; i >= 0; --i)
+                submit_job(&jobs[i]);
+        wait_job(&all);
+}
 
-        glBindVertexArray(map_vao);
+/* Start the job threads, threads - 1 of them besides the main thread,
+   or one per core if 0. */
+static void
+init_jobs(int threads)
+{
+        if (threads <= 0)
+                threads = SDL_GetCPUCount();
+        if (threads > MAX_JOB_THREADS)
+                threads = MAX_JOB_THREADS;
+        if (threads < 1)
+                threads = 1;
 
-        glBindBuffer(GL_ARRAY_BUFFER, map_vbo);
-        glBufferData(GL_ARRAY_BUFFER,
-                     sizeof(vertex_data),
-                     vertex_data,
-                     GL_STATIC_DRAW);
+        job_thread_count = threads;
+        own_job_queue = 0;
+        jobs_queued = SDL_CreateSemaphore(0);
 
-        GLint index_attr = glGetAttribLocation(map_program, "index");
-        glVertexAttribIPointer(index_attr, 1, GL_INT, 1 * sizeof(int),
-                               (void *) 0);
-        glEnableVertexAttribArray(index_attr);
+        for (int i = 1; i < job_thread_count; ++i) {
+                job_threads[i] = SDL_CreateThread(job_thread_main, "jobs",
+                                                  (void *) (intptr_t) i);
+                if (!job_threads[i]) {
+                        printf("Could not start job thread. SDL_Error: %s\n",
+                               SDL_GetError());
+                        exit(1);
+                }
+        }
+}
+
+static void
+quit_jobs(void)
+{
+        SDL_AtomicSet(&jobs_quit, 1);
+        for (int i = 1; i < job_thread_count; ++i)
+                SDL_SemPost(jobs_queued);
+        for (int i = 1; i < job_thread_count; ++i)
+                SDL_WaitThread(job_threads[i], NULL);
+}
+
+static float
+obj_base_y(int i)
+{
+        return objects.y[i] + objects.base_y[i] * objects.height[i];
+}
+
+/* Index of the object a handle refers to, or -1 if it has been
+   despawned. */
+static int
+object_index(object_handle handle)
+{
+        int slot = handle & OBJ_HANDLE_SLOT_MASK;
+
+        if (slot >= obj_slot_count ||
+            obj_slots[slot].generation != handle >> OBJ_HANDLE_SLOT_BITS)
+                return -1;
+
+        return obj_slots[slot].index;
+}
+
+/* Drop the handles of despawned objects from obj_order. */
+static void
+compact_obj_order(void)
+{
+        int count = 0;
+
+        for (int i = 0; i < obj_order_count; ++i)
+                if (object_index(obj_order[i]) >= 0)
+                        obj_order[count++] = obj_order[i];
+
+        /* Objects have changed places, so the next sort cannot tell
+           which. */
+        obj_order_count = count;
+        obj_sorted_count = 0;
+}
+
+/* Grid column or row of a map coordinate, for a grid size cells wide
+   or high. */
+static int
+grid_coord(float pos, int size)
+{
+        if (pos <= 0.0f)
+                return 0;
+        if (pos >= (size - 1) * OBJ_GRID_CELL)
+                return size - 1;
+
+        return pos / OBJ_GRID_CELL;
+}
+
+/* Take an object out of its grid cell. */
+static void
+unfile_object(int i)
+{
+        int cell = objects.grid_cell[i];
+        int prev = objects.grid_prev[i];
+        int next = objects.grid_next[i];
+
+        if (cell < 0)
+                return;
+
+        if (prev >= 0)
+                objects.grid_next[prev] = next;
+        else
+                obj_grid[cell] = next;
+        if (next >= 0)
+                objects.grid_prev[next] = prev;
+
+        objects.grid_cell[i] = -1;
+}
+
+/* Put an object in the grid cell it is over, if not already there. */
+static void
+file_object(int i)
+{
+        int cell = grid_coord(objects.y[i], obj_grid_h) * obj_grid_w +
+                grid_coord(objects.x[i], obj_grid_w);
+
+        if (cell == objects.grid_cell[i])
+                return;
+
+        unfile_object(i);
+
+        objects.grid_cell[i] = cell;
+        objects.grid_prev[i] = -1;
+        objects.grid_next[i] = obj_grid[cell];
+        if (obj_grid[cell] >= 0)
+                objects.grid_prev[obj_grid[cell]] = i;
+        obj_grid[cell] = i;
+}
+
+/* Mark an object as changed, for the next uploads to include it, and
+   keep it in the right grid cell. */
+static void
+touch_object(int i)
+{
+        objects.changed[i] = obj_upload_serial + 1;
+        objects_dirty = 1;
+        file_object(i);
+}
+
+static void *
+alloc_column(int capacity)
+{
+        void *column = aligned_alloc(OBJ_ALIGN, capacity * sizeof(float));
+
+        if (!column) {
+                printf("Could not allocate memory for %d objects.\n",
+                       capacity);
+                exit(1);
+        }
+
+        return column;
+}
+
+/* All the object arrays have 4-byte elements. */
+static void *
+grow_column(void *column, int capacity)
+{
+        void *grown = alloc_column(capacity);
+
+        if (column)
+                memcpy(grown, column, obj_count * sizeof(float));
+        free(column);
+
+        return grown;
+}
+
+static void
+reserve_objects(int count)
+{
+        if (count <= obj_capacity)
+                return;
+
+        if (count > MAX_OBJECTS) {
+                printf("Too many objects, at most %d are supported.\n",
+                       MAX_OBJECTS);
+                exit(1);
+        }
+
+        /* A multiple of 64 elements keeps the sizes a multiple of the
+           alignment, as aligned_alloc requires. */
+        if (obj_capacity == 0)
+                obj_capacity = 64;
+        while (obj_capacity < count)
+                obj_capacity *= 2;
+
+        objects.x = grow_column(objects.x, obj_capacity);
+        objects.y = grow_column(objects.y, obj_capacity);
+        objects.vx = grow_column(objects.vx, obj_capacity);
+        objects.vy = grow_column(objects.vy, obj_capacity);
+        objects.base_y = grow_column(objects.base_y, obj_capacity);
+        objects.width = grow_column(objects.width, obj_capacity);
+        objects.height = grow_column(objects.height, obj_capacity);
+        objects.sprite = grow_column(objects.sprite, obj_capacity);
+        objects.clip = grow_column(objects.clip, obj_capacity);
+        objects.clip_start = grow_column(objects.clip_start, obj_capacity);
+        objects.tint = grow_column(objects.tint, obj_capacity);
+        objects.type = grow_column(objects.type, obj_capacity);
+        objects.flags = grow_column(objects.flags, obj_capacity);
+        objects.handle = grow_column(objects.handle, obj_capacity);
+        objects.changed = grow_column(objects.changed, obj_capacity);
+        objects.grid_cell = grow_column(objects.grid_cell, obj_capacity);
+        objects.grid_next = grow_column(objects.grid_next, obj_capacity);
+        objects.grid_prev = grow_column(objects.grid_prev, obj_capacity);
+
+        /* There is never a slot for more objects than there is room
+           for, since free slots are reused first. */
+        obj_slots = realloc(obj_slots,
+                            obj_capacity * sizeof(struct obj_slot));
+        if (!obj_slots) {
+                printf("Could not allocate memory for %d objects.\n",
+                       obj_capacity);
+                exit(1);
+        }
+
+        compact_obj_order();
+        obj_order = grow_column(obj_order, obj_capacity);
+        obj_order_changed = grow_column(obj_order_changed, obj_capacity);
+
+        free(obj_sort_keys);
+        free(obj_draw_order);
+        free(obj_sort_keys_spare);
+        free(obj_draw_order_spare);
+        free(obj_visible);
+        obj_sort_keys = alloc_column(obj_capacity);
+        obj_draw_order = alloc_column(obj_capacity);
+        obj_sort_keys_spare = alloc_column(obj_capacity);
+        obj_draw_order_spare = alloc_column(obj_capacity);
+        obj_visible = alloc_column(obj_capacity);
+}
+
+static void
+set_object_sprite(int i, int sprite)
+{
+        objects.sprite[i] = sprite;
+        objects.base_y[i] = object_sprites[sprite].base_y;
+        objects.width[i] = object_sprites[sprite].width;
+        objects.height[i] = object_sprites[sprite].height;
+}
+
+static void
+set_object(int i, const struct object *obj)
+{
+        objects.x[i] = obj->x;
+        objects.y[i] = obj->y;
+        objects.vx[i] = obj->vx;
+        objects.vy[i] = obj->vy;
+        objects.clip[i] = obj->clip;
+        if (obj->clip) {
+                set_object_sprite(i, object_clips[obj->clip].sprite);
+                objects.clip_start[i] = SDL_GetTicks();
+        } else {
+                set_object_sprite(i, obj->sprite);
+                objects.clip_start[i] = 0;
+        }
+        objects.tint[i] = obj->tint;
+        objects.type[i] = obj->type;
+        objects.flags[i] = obj->flags;
+
+        if (obj->vx != 0.0f || obj->vy != 0.0f)
+                objects_moving = 1;
+        touch_object(i);
+}
+
+/* Add an object to the world, returning its handle. */
+static object_handle
+spawn_object(const struct object *obj)
+{
+        object_handle handle;
+        int slot;
+        int i;
+
+        reserve_objects(obj_count + 1);
+        if (obj_order_count == obj_capacity)
+                compact_obj_order();
+
+        if (obj_free_slot >= 0) {
+                slot = obj_free_slot;
+                obj_free_slot = obj_slots[slot].index;
+        } else {
+                slot = obj_slot_count++;
+                obj_slots[slot].generation = 0;
+        }
+
+        i = obj_count++;
+        handle = obj_slots[slot].generation << OBJ_HANDLE_SLOT_BITS | slot;
+        obj_slots[slot].index = i;
+        objects.handle[i] = handle;
+        objects.grid_cell[i] = -1;
+        set_object(i, obj);
+
+        obj_order[obj_order_count++] = handle;
+
+        return handle;
+}
+
+static void
+spawn_objects(const struct object *objs, int count)
+{
+        reserve_objects(obj_count + count);
+        for (int i = 0; i < count; ++i)
+                spawn_object(&objs[i]);
+}
+
+/* Copy object src over object dst, which takes its place. */
+static void
+move_object(int dst, int src)
+{
+        objects.x[dst] = objects.x[src];
+        objects.y[dst] = objects.y[src];
+        objects.vx[dst] = objects.vx[src];
+        objects.vy[dst] = objects.vy[src];
+        objects.base_y[dst] = objects.base_y[src];
+        objects.width[dst] = objects.width[src];
+        objects.height[dst] = objects.height[src];
+        objects.sprite[dst] = objects.sprite[src];
+        objects.clip[dst] = objects.clip[src];
+        objects.clip_start[dst] = objects.clip_start[src];
+        objects.tint[dst] = objects.tint[src];
+        objects.type[dst] = objects.type[src];
+        objects.flags[dst] = objects.flags[src];
+        objects.handle[dst] = objects.handle[src];
+        objects.changed[dst] = objects.changed[src];
+        objects.grid_cell[dst] = objects.grid_cell[src];
+        objects.grid_next[dst] = objects.grid_next[src];
+        objects.grid_prev[dst] = objects.grid_prev[src];
+
+        obj_slots[objects.handle[dst] & OBJ_HANDLE_SLOT_MASK].index = dst;
+
+        /* Take its place in its grid cell too. */
+        if (dst != src && objects.grid_cell[dst] >= 0) {
+                if (objects.grid_prev[dst] >= 0)
+                        objects.grid_next[objects.grid_prev[dst]] = dst;
+                else
+                        obj_grid[objects.grid_cell[dst]] = dst;
+                if (objects.grid_next[dst] >= 0)
+                        objects.grid_prev[objects.grid_next[dst]] = dst;
+        }
+}
+
+/* Remove an object from the world. Its handle, and any copies of it,
+   no longer refer to anything; despawning it again does nothing. */
+static void
+despawn_object(object_handle handle)
+{
+        int slot = handle & OBJ_HANDLE_SLOT_MASK;
+        int i = object_index(handle);
+
+        if (i < 0)
+                return;
+
+        unfile_object(i);
+        move_object(i, --obj_count);
+
+        obj_slots[slot].generation =
+                (obj_slots[slot].generation + 1) & OBJ_GENERATION_MASK;
+        obj_slots[slot].index = obj_free_slot;
+        obj_free_slot = slot;
+        objects_dirty = 1;
+}
+
+static void
+despawn_objects(const object_handle *handles, int count)
+{
+        for (int i = 0; i < count; ++i)
+                despawn_object(handles[i]);
+}
+
+/* Find the objects within radius of the rectangle from (x0, y0) to (x1,
+   y1), writing the indices of up to max of them to found. Returns how
+   many there are, which may be more than max. The indices are only
+   good until objects are spawned or despawned. */
+static int
+find_objects_near(float x0, float y0, float x1, float y1, float radius,
+                  int *found, int max)
+{
+        int cx0 = grid_coord(x0 - radius - obj_grid_reach_x, obj_grid_w);
+        int cy0 = grid_coord(y0 - radius - obj_grid_reach_y, obj_grid_h);
+        int cx1 = grid_coord(x1 + radius, obj_grid_w);
+        int cy1 = grid_coord(y1 + radius, obj_grid_h);
+        int count = 0;
+        float dx, dy;
+
+        for (int cy = cy0; cy <= cy1; ++cy) {
+                for (int cx = cx0; cx <= cx1; ++cx) {
+                        int i = obj_grid[cy * obj_grid_w + cx];
+
+                        for (; i >= 0; i = objects.grid_next[i]) {
+                                /* distance between the rectangles */
+                                dx = fmaxf(objects.x[i] - x1,
+                                           x0 - objects.x[i] - objects.width[i]);
+                                dy = fmaxf(objects.y[i] - y1,
+                                           y0 - objects.y[i] - objects.height[i]);
+                                dx = fmaxf(dx, 0.0f);
+                                dy = fmaxf(dy, 0.0f);
+                                if (dx * dx + dy * dy > radius * radius)
+                                        continue;
+
+                                if (count < max)
+                                        found[count] = i;
+                                ++count;
+                        }
+                }
+        }
+
+        return count;
+}
+
+static int
+find_objects_in_rect(float x0, float y0, float x1, float y1,
+                     int *found, int max)
+{
+        return find_objects_near(x0, y0, x1, y1, 0.0f, found, max);
+}
+
+static int
+find_objects_in_radius(float x, float y, float radius,
+                       int *found, int max)
+{
+        return find_objects_near(x, y, x, y, radius, found, max);
+}
+
+static int
+find_objects_at(float x, float y, int *found, int max)
+{
+        return find_objects_near(x, y, x, y, 0.0f, found, max);
+}
+
+/* Map coordinates of a point in the window, in pixels from its
+   top-left corner. */
+static void
+window_to_map(int window_x, int window_y, float *x, float *y)
+{
+        /* The camera rectangle is stretched over the viewport. */
+        *x = cam_x + window_x * cam_w * zoom / view_w;
+        *y = cam_y + (view_h - window_y) * cam_h * zoom / view_h;
+}
+
+/* Index of the frontmost object under a point in the window, or -1 if
+   there is none. */
+static int
+pick_object(int window_x, int window_y)
+{
+        float x, y;
+        int *found;
+        int count;
+        int picked = -1;
+
+        window_to_map(window_x, window_y, &x, &y);
+        count = find_objects_at(x, y, NULL, 0);
+        if (count == 0)
+                return -1;
+
+        found = malloc(count * sizeof(int));
+        find_objects_at(x, y, found, count);
+
+        /* Objects with their base further down are in front. */
+        for (int i = 0; i < count; ++i)
+                if (picked < 0 || obj_base_y(found[i]) < obj_base_y(picked))
+                        picked = found[i];
+
+        free(found);
+
+        return picked;
+}
+
+/* Start playing a clip on an object from its first frame, or stop
+   playing one, leaving the object at the first frame, with clip 0. */
+static void
+play_object_clip(object_handle handle, int clip)
+{
+        int i = object_index(handle);
+
+        if (i < 0)
+                return;
+
+        if (clip)
+                set_object_sprite(i, object_clips[clip].sprite);
+        objects.clip[i] = clip;
+        objects.clip_start[i] = SDL_GetTicks();
+        touch_object(i);
+}
+
+/* Move objects [start, end) along one axis, turning them around when
+   they go past either end of [0, max]. The SIMD versions do the same
+   for as many objects as they can, returning where they stopped. */
+static void
+integrate_axis(float *pos, float *vel, int start, int end,
+               float dt, float max)
+{
+        for (int i = start; i < end; ++i) {
+                pos[i] += vel[i] * dt;
+                if ((pos[i] < 0.0f && vel[i] < 0.0f) ||
+                    (pos[i] > max && vel[i] > 0.0f))
+                        vel[i] = -vel[i];
+        }
+}
+
+#ifdef __x86_64__
+static int
+integrate_axis_sse(float *pos, float *vel, int start, int end,
+                   float dt, float max)
+{
+        __m128 dt4 = _mm_set1_ps(dt);
+        __m128 max4 = _mm_set1_ps(max);
+        __m128 zero = _mm_setzero_ps();
+        __m128 sign = _mm_set1_ps(-0.0f);
+        __m128 p, v, turn;
+        int i;
+
+        for (i = start; i + 4 <= end; i += 4) {
+                p = _mm_load_ps(pos + i);
+                v = _mm_load_ps(vel + i);
+                p = _mm_add_ps(p, _mm_mul_ps(v, dt4));
+                turn = _mm_or_ps(_mm_and_ps(_mm_cmplt_ps(p, zero),
+                                            _mm_cmplt_ps(v, zero)),
+                                 _mm_and_ps(_mm_cmpgt_ps(p, max4),
+                                            _mm_cmpgt_ps(v, zero)));
+                v = _mm_xor_ps(v, _mm_and_ps(turn, sign));
+                _mm_store_ps(pos + i, p);
+                _mm_store_ps(vel + i, v);
+        }
+
+        return i;
+}
+
+__attribute__((target("avx")))
+static int
+integrate_axis_avx(float *pos, float *vel, int start, int end,
+                   float dt, float max)
+{
+        __m256 dt8 = _mm256_set1_ps(dt);
+        __m256 max8 = _mm256_set1_ps(max);
+        __m256 zero = _mm256_setzero_ps();
+        __m256 sign = _mm256_set1_ps(-0.0f);
+        __m256 p, v, turn;
+        int i;
+
+        for (i = start; i + 8 <= end; i += 8) {
+                p = _mm256_load_ps(pos + i);
+                v = _mm256_load_ps(vel + i);
+                p = _mm256_add_ps(p, _mm256_mul_ps(v, dt8));
+                turn = _mm256_or_ps(
+                        _mm256_and_ps(_mm256_cmp_ps(p, zero, _CMP_LT_OQ),
+                                      _mm256_cmp_ps(v, zero, _CMP_LT_OQ)),
+                        _mm256_and_ps(_mm256_cmp_ps(p, max8, _CMP_GT_OQ),
+                                      _mm256_cmp_ps(v, zero, _CMP_GT_OQ)));
+                v = _mm256_xor_ps(v, _mm256_and_ps(turn, sign));
+                _mm256_store_ps(pos + i, p);
+                _mm256_store_ps(vel + i, v);
+        }
+
+        return i;
+}
+#endif
+
+/* Objects are split among jobs in multiples of this many, which keeps
+   the ranges aligned for SIMD. */
+#define OBJ_JOB_GRAIN 2048
+
+/* Job moving objects [start, end) by *data seconds. */
+static void
+integrate_objects(void *data, int start, int end)
+{
+        float dt = *(float *) data;
+        float *pos[2] = { objects.x, objects.y };
+        float *vel[2] = { objects.vx, objects.vy };
+        float max[2] = { map_width, map_height };
+        int done = start;
+
+        for (int axis = 0; axis < 2; ++axis) {
+#ifdef __x86_64__
+                if (have_avx)
+                        done = integrate_axis_avx(pos[axis], vel[axis],
+                                                  start, end,
+                                                  dt, max[axis]);
+                else
+                        done = integrate_axis_sse(pos[axis], vel[axis],
+                                                  start, end,
+                                                  dt, max[axis]);
+#endif
+                integrate_axis(pos[axis], vel[axis], done, end,
+                               dt, max[axis]);
+        }
+}
+
+/* Move the objects that have a velocity. */
+static void
+update_objects(float dt)
+{
+        if (!objects_moving)
+                return;
+
+        parallel_for(obj_count, OBJ_JOB_GRAIN, integrate_objects, &dt);
+
+        for (int i = 0; i < obj_count; ++i)
+                if (objects.vx[i] != 0.0f || objects.vy[i] != 0.0f)
+                        touch_object(i);
+}
+
+/* Set obj_visible for objects [start, end), as overlapping the
+   rectangle from (x0, y0) to (x1, y1) or not. The SIMD versions do the
+   same for as many objects as they can, returning where they
+   stopped. */
+static void
+cull_range(int start, int end, float x0, float y0, float x1, float y1)
+{
+        for (int i = start; i < end; ++i)
+                obj_visible[i] = objects.x[i] < x1 &&
+                        objects.x[i] + objects.width[i] > x0 &&
+                        objects.y[i] < y1 &&
+                        objects.y[i] + objects.height[i] > y0 ? ~0u : 0;
+}
+
+#ifdef __x86_64__
+static int
+cull_range_sse(int start, int end, float x0, float y0, float x1, float y1)
+{
+        __m128 min_x = _mm_set1_ps(x0);
+        __m128 min_y = _mm_set1_ps(y0);
+        __m128 max_x = _mm_set1_ps(x1);
+        __m128 max_y = _mm_set1_ps(y1);
+        __m128 x, y, w, h, in;
+        int i;
+
+        for (i = start; i + 4 <= end; i += 4) {
+                x = _mm_load_ps(objects.x + i);
+                y = _mm_load_ps(objects.y + i);
+                w = _mm_load_ps(objects.width + i);
+                h = _mm_load_ps(objects.height + i);
+                in = _mm_and_ps(_mm_cmplt_ps(x, max_x),
+                                _mm_cmpgt_ps(_mm_add_ps(x, w), min_x));
+                in = _mm_and_ps(in, _mm_cmplt_ps(y, max_y));
+                in = _mm_and_ps(in, _mm_cmpgt_ps(_mm_add_ps(y, h), min_y));
+                _mm_store_ps((float *) (obj_visible + i), in);
+        }
+
+        return i;
+}
+
+__attribute__((target("avx")))
+static int
+cull_range_avx(int start, int end, float x0, float y0, float x1, float y1)
+{
+        __m256 min_x = _mm256_set1_ps(x0);
+        __m256 min_y = _mm256_set1_ps(y0);
+        __m256 max_x = _mm256_set1_ps(x1);
+        __m256 max_y = _mm256_set1_ps(y1);
+        __m256 x, y, w, h, in;
+        int i;
+
+        for (i = start; i + 8 <= end; i += 8) {
+                x = _mm256_load_ps(objects.x + i);
+                y = _mm256_load_ps(objects.y + i);
+                w = _mm256_load_ps(objects.width + i);
+                h = _mm256_load_ps(objects.height + i);
+                in = _mm256_and_ps(
+                        _mm256_cmp_ps(x, max_x, _CMP_LT_OQ),
+                        _mm256_cmp_ps(_mm256_add_ps(x, w), min_x, _CMP_GT_OQ));
+                in = _mm256_and_ps(in, _mm256_cmp_ps(y, max_y, _CMP_LT_OQ));
+                in = _mm256_and_ps(
+                        in,
+                        _mm256_cmp_ps(_mm256_add_ps(y, h), min_y, _CMP_GT_OQ));
+                _mm256_store_ps((float *) (obj_visible + i), in);
+        }
+
+        return i;
+}
+#endif
+
+/* Job culling objects [start, end) against the rectangle *data
+   points to, as x0, y0, x1, y1. */
+static void
+cull_objects_job(void *data, int start, int end)
+{
+        const float *rect = data;
+        int done = start;
+
+#ifdef __x86_64__
+        if (have_avx)
+                done = cull_range_avx(start, end,
+                                      rect[0], rect[1], rect[2], rect[3]);
+        else
+                done = cull_range_sse(start, end,
+                                      rect[0], rect[1], rect[2], rect[3]);
+#endif
+        cull_range(done, end, rect[0], rect[1], rect[2], rect[3]);
+}
+
+/* Find the objects in view, as far as their sprite rectangles go. */
+static void
+cull_objects(void)
+{
+        float rect[4] = {
+                cam_x,
+                cam_y,
+                cam_x + cam_w * zoom,
+                cam_y + cam_h * zoom,
+        };
+
+        parallel_for(obj_count, OBJ_JOB_GRAIN, cull_objects_job, rect);
+}
+
+/* Fill in the instance records of the objects at positions [start,
+   end) of the drawing order, from data on. */
+static void
+pack_objects(struct obj_instance *data, int start, int end)
+{
+        for (int i = start; i < end; ++i) {
+                int j = obj_draw_order[i];
+                struct obj_instance *instance = data + i - start;
+                instance->x = objects.x[j];
+                instance->y = objects.y[j];
+                instance->flags = objects.flags[j];
+                instance->tint = objects.tint[j];
+                if (objects.clip[j]) {
+                        instance->sprite = objects.clip[j];
+                        instance->flags |= OBJ_ANIMATED;
+                        instance->clip_start = objects.clip_start[j];
+                } else {
+                        instance->sprite = objects.sprite[j];
+                        instance->clip_start = 0;
+                }
+        }
+}
+
+/* Job packing the records at positions [start, end) of the drawing
+   order into the array of records *data points to. */
+static void
+pack_objects_job(void *data, int start, int end)
+{
+        pack_objects((struct obj_instance *) data + start, start, end);
+}
+
+/* Objects further up are drawn first, so keys grow downwards from the
+   top of the map. */
+static Uint32
+sort_key(int i)
+{
+        float key;
+
+        key = (map_height - obj_base_y(i)) * SORT_KEY_SCALE;
+        if (key <= 0.0f)
+                return 0;
+        if (key >= (float) SORT_KEY_MAX)
+                return SORT_KEY_MAX;
+
+        return key;
+}
+
+/* Insertion sort the keys in [start, end), which is linear when the
+   objects are still almost in the order of the last sort. Gives up,
+   returning 0, once it has done more moves than there are keys, since
+   the order then changed too much for it. */
+static int
+insertion_sort_objects(int start, int end)
+{
+        Uint32 key;
+        int index;
+        int moves = 0;
+        int i, j;
+
+        for (i = start + 1; i < end; ++i) {
+                key = obj_sort_keys[i];
+                index = obj_draw_order[i];
+
+                j = i - 1;
+                while (j >= start && obj_sort_keys[j] > key) {
+                        obj_sort_keys[j + 1] = obj_sort_keys[j];
+                        obj_draw_order[j + 1] = obj_draw_order[j];
+                        --j;
+                }
+
+                obj_sort_keys[j + 1] = key;
+                obj_draw_order[j + 1] = index;
+
+                moves += i - 1 - j;
+                if (moves > end - start)
+                        return 0;
+        }
+
+        return 1;
+}
+
+/* LSD radix sort of the keys in [start, end), a byte at a time. The
+   histograms of all the bytes are taken in a single pass, and passes
+   over bytes that are the same in all the keys skipped. */
+static void
+radix_sort_objects(int start, int end)
+{
+        static int counts[4][256];
+        Uint32 *keys = obj_sort_keys + start;
+        Uint32 *keys_spare = obj_sort_keys_spare + start;
+        int *order = obj_draw_order + start;
+        int *order_spare = obj_draw_order_spare + start;
+        int count = end - start;
+        Uint32 *swap_keys;
+        int *swap_order;
+        Uint32 key;
+        int digit;
+        int offset, n;
+
+        memset(counts, 0, sizeof(counts));
+        for (int i = 0; i < count; ++i) {
+                key = keys[i];
+                ++counts[0][key & 0xff];
+                ++counts[1][key >> 8 & 0xff];
+                ++counts[2][key >> 16 & 0xff];
+                ++counts[3][key >> 24];
+        }
+
+        for (int pass = 0; pass < 4; ++pass) {
+                int shift = 8 * pass;
+
+                if (counts[pass][keys[0] >> shift & 0xff] == count)
+                        continue;
+
+                offset = 0;
+                for (digit = 0; digit < 256; ++digit) {
+                        n = counts[pass][digit];
+                        counts[pass][digit] = offset;
+                        offset += n;
+                }
+
+                for (int i = 0; i < count; ++i) {
+                        key = keys[i];
+                        offset = counts[pass][key >> shift & 0xff]++;
+                        keys_spare[offset] = key;
+                        order_spare[offset] = order[i];
+                }
+
+                swap_keys = keys;
+                keys = keys_spare;
+                keys_spare = swap_keys;
+
+                swap_order = order;
+                order = order_spare;
+                order_spare = swap_order;
+        }
+
+        /* The rest of the arrays are only in the one they started in. */
+        if (keys != obj_sort_keys + start) {
+                memcpy(obj_sort_keys + start, keys, count * sizeof(Uint32));
+                memcpy(obj_draw_order + start, order, count * sizeof(int));
+        }
+}
+
+/* Sort the keys in [start, end). */
+static void
+sort_object_range(int start, int end)
+{
+        /* Starting from the last order, insertion sort is fast unless
+           the objects moved around a lot. When it gives up, the keys
+           are still paired up with their objects, so radix sort can
+           take over from there. */
+        if (!insertion_sort_objects(start, end))
+                radix_sort_objects(start, end);
+}
+
+/* Work out the drawing order of the objects in view: opaque objects
+   first, then translucent ones, keeping to the last order within each,
+   and then sort each as object_order says. */
+static void
+sort_objects(void)
+{
+        int sort_opaque = object_order == OBJECT_ORDER_SORT;
+        int count = 0;
+        int hidden;
+        int index;
+
+        cull_objects();
+
+        for (int pass = 0; pass < 2; ++pass) {
+                int translucent = pass * OBJ_TRANSLUCENT;
+
+                for (int i = 0; i < obj_order_count; ++i) {
+                        index = object_index(obj_order[i]);
+                        if (index < 0 || !obj_visible[index] ||
+                            (objects.flags[index] & OBJ_TRANSLUCENT) != translucent)
+                                continue;
+
+                        if (translucent || sort_opaque)
+                                obj_sort_keys[count] = sort_key(index);
+                        obj_draw_order[count++] = index;
+                }
+
+                if (!translucent)
+                        obj_opaque_count = count;
+        }
+        obj_draw_count = count;
+
+        if (sort_opaque)
+                sort_object_range(0, obj_opaque_count);
+        sort_object_range(obj_opaque_count, obj_draw_count);
+
+        obj_reordered = 0;
+        for (int i = 0; i < obj_draw_count; ++i) {
+                if (i >= obj_sorted_count ||
+                    obj_order[i] != objects.handle[obj_draw_order[i]]) {
+                        obj_order_changed[i] = obj_upload_serial + 1;
+                        ++obj_reordered;
+                }
+        }
+
+        /* Move the objects out of view to the end, in their order, for
+           when they come back into view; then put the ones in view in
+           front of them. */
+        hidden = obj_order_count;
+        for (int i = obj_order_count - 1; i >= 0; --i) {
+                index = object_index(obj_order[i]);
+                if (index >= 0 && !obj_visible[index])
+                        obj_order[--hidden] = obj_order[i];
+        }
+        memmove(obj_order + obj_draw_count, obj_order + hidden,
+                (obj_order_count - hidden) * sizeof(object_handle));
+
+        for (int i = 0; i < obj_draw_count; ++i)
+                obj_order[i] = objects.handle[obj_draw_order[i]];
+        obj_order_count = obj_count;
+        obj_sorted_count = obj_draw_count;
+}
+
+/* Wait until the GPU is done drawing from a region of the ring. */
+static void
+wait_obj_region(int region)
+{
+        GLenum status;
+
+        if (!obj_ring_fences[region])
+                return;
+
+        do {
+                status = glClientWaitSync(obj_ring_fences[region],
+                                          GL_SYNC_FLUSH_COMMANDS_BIT,
+                                          1000000000);
+        } while (status == GL_TIMEOUT_EXPIRED);
+
+        glDeleteSync(obj_ring_fences[region]);
+        obj_ring_fences[region] = NULL;
+}
+
+/* Called after drawing the objects, for the next upload to the region
+   to wait on. */
+static void
+fence_obj_region(void)
+{
+        if (obj_ring_fences[obj_ring_region])
+                glDeleteSync(obj_ring_fences[obj_ring_region]);
+
+        obj_ring_fences[obj_ring_region] =
+                glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/* Replace the instance buffer with one with regions of
+   obj_instance_capacity objects. Buffers with immutable storage
+   cannot be resized, so this is a new buffer either way. */
+static void
+alloc_obj_ring(void)
+{
+        GLsizeiptr size = OBJ_RING_REGIONS * obj_instance_capacity *
+                sizeof(struct obj_instance);
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                GL_MAP_COHERENT_BIT;
+
+        /* The old buffer is kept around until the GPU is done with it,
+           so there is nothing left to wait for. */
+        for (int i = 0; i < OBJ_RING_REGIONS; ++i) {
+                if (obj_ring_fences[i])
+                        glDeleteSync(obj_ring_fences[i]);
+                obj_ring_fences[i] = NULL;
+                obj_ring_serials[i] = 0;
+        }
+
+        glDeleteBuffers(1, &object_instance_vbo);
+        glGenBuffers(1, &object_instance_vbo);
+        glBindBuffer(GL_ARRAY_BUFFER, object_instance_vbo);
+
+        if (buffer_storage) {
+                buffer_storage(GL_ARRAY_BUFFER, size, NULL, flags);
+                obj_ring_data = glMapBufferRange(GL_ARRAY_BUFFER, 0, size,
+                                                 flags);
+                if (!obj_ring_data) {
+                        printf("Could not map the object instance buffer.\n");
+                        exit(1);
+                }
+        } else {
+                glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+        }
+}
+
+/* Point the instance attributes at the records starting at offset in
+   the instance buffer. Both the buffer and the object VAO must be
+   bound. */
+static void
+set_object_attributes(GLintptr offset)
+{
+        GLsizei stride = sizeof(struct obj_instance);
+
+        glVertexAttribPointer(obj_position_attr, 2, GL_FLOAT, GL_FALSE,
+                              stride,
+                              (void *) (offset + offsetof(struct obj_instance, x)));
+        glVertexAttribIPointer(obj_sprite_attr, 1, GL_UNSIGNED_SHORT,
+                               stride,
+                               (void *) (offset + offsetof(struct obj_instance, sprite)));
+        glVertexAttribIPointer(obj_bits_attr, 2, GL_UNSIGNED_BYTE,
+                               stride,
+                               (void *) (offset + offsetof(struct obj_instance, flags)));
+        glVertexAttribIPointer(obj_clip_start_attr, 1, GL_UNSIGNED_INT,
+                               stride,
+                               (void *) (offset + offsetof(struct obj_instance, clip_start)));
+}
+
+/* Whether the record at position i of the drawing order changed after
+   upload since. */
+static int
+obj_record_stale(int i, Uint32 since)
+{
+        return obj_order_changed[i] > since ||
+                objects.changed[obj_draw_order[i]] > since;
+}
+
+static void
+update_object_data(void)
+{
+        GLintptr offset;
+        GLsizeiptr record = sizeof(struct obj_instance);
+        GLbitfield access;
+        Uint32 since;
+        struct obj_instance *data;
+        int first, last, origin;
+        int full;
+        int i, j;
+
+        sort_objects();
+
+        objects_dirty = 0;
+        if (obj_draw_count == 0)
+                return;
+
+        /* The buffer only grows, geometrically, when the objects in
+           view no longer fit. */
+        if (obj_draw_count > obj_instance_capacity) {
+                if (obj_instance_capacity == 0)
+                        obj_instance_capacity = 64;
+                while (obj_instance_capacity < obj_draw_count)
+                        obj_instance_capacity *= 2;
+
+                alloc_obj_ring();
+        }
+
+        obj_ring_region = (obj_ring_region + 1) % OBJ_RING_REGIONS;
+        wait_obj_region(obj_ring_region);
+        offset = obj_ring_region * obj_instance_capacity * record;
+        obj_ring_offset = offset;
+
+        since = obj_ring_serials[obj_ring_region];
+        full = since == 0 ||
+                obj_reordered > obj_draw_count / OBJ_REORDER_FULL_UPLOAD;
+
+        /* Only the span from the first to the last stale record is
+           mapped, and only the stale records in it written. */
+        first = 0;
+        last = obj_draw_count;
+        if (!full) {
+                while (first < last && !obj_record_stale(first, since))
+                        ++first;
+                while (last > first && !obj_record_stale(last - 1, since))
+                        --last;
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, object_instance_vbo);
+
+        if (first < last) {
+                /* Position of the record data points at. */
+                origin = obj_ring_data ? 0 : first;
+
+                if (obj_ring_data) {
+                        data = obj_ring_data + offset / record;
+                } else {
+                        /* Invalidating the span would lose the records
+                           in it that are not rewritten. */
+                        access = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+                        access |= full ? GL_MAP_INVALIDATE_RANGE_BIT :
+                                GL_MAP_FLUSH_EXPLICIT_BIT;
+                        data = glMapBufferRange(GL_ARRAY_BUFFER,
+                                                offset + first * record,
+                                                (last - first) * record,
+                                                access);
+                }
+
+                if (full) {
+                        parallel_for(obj_draw_count, OBJ_JOB_GRAIN,
+                                     pack_objects_job, data);
+                        obj_upload_bytes += obj_draw_count * record;
+                } else {
+                        for (i = first; i < last; i = j + 1) {
+                                j = i;
+                                while (j < last && obj_record_stale(j, since))
+                                        ++j;
+                                if (j == i)
+                                        continue;
+
+                                pack_objects(data + i - origin, i, j);
+                                obj_upload_bytes += (j - i) * record;
+                                if (!obj_ring_data)
+                                        glFlushMappedBufferRange(
+                                                GL_ARRAY_BUFFER,
+                                                (i - first) * record,
+                                                (j - i) * record);
+                        }
+                }
+
+                if (!obj_ring_data)
+                        glUnmapBuffer(GL_ARRAY_BUFFER);
+        }
+
+        obj_ring_serials[obj_ring_region] = ++obj_upload_serial;
+
+        glBindVertexArray(object_vao);
+        set_object_attributes(offset);
+        glBindVertexArray(0);
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/* Find the objects in view, except for the player, writing their
+   handles to a newly allocated array. Returns how many there are. */
+static int
+find_visible_objects(object_handle **handles)
+{
+        int *found;
+        int count;
+        int n = 0;
+
+        found = malloc(obj_count * sizeof(int));
+        count = find_objects_in_rect(cam_x, cam_y,
+                                     cam_x + cam_w * zoom,
+                                     cam_y + cam_h * zoom,
+                                     found, obj_count);
+
+        *handles = malloc(count * sizeof(object_handle));
+        for (int i = 0; i < count; ++i)
+                if (objects.type[found[i]] == OTHER)
+                        (*handles)[n++] = objects.handle[found[i]];
+
+        free(found);
+
+        return n;
+}
+
+/* Despawn the objects in view, except for the player. */
+static void
+despawn_visible_objects(void)
+{
+        object_handle *victims;
+        int count;
+
+        count = find_visible_objects(&victims);
+        despawn_objects(victims, count);
+        free(victims);
+}
+
+/* Have the objects in view, except for the player, play the first
+   clip. */
+static void
+animate_visible_objects(void)
+{
+        object_handle *handles;
+        int count;
+
+        count = find_visible_objects(&handles);
+        for (int i = 0; i < count; ++i)
+                play_object_clip(handles[i], 1);
+        free(handles);
+}
+
+/* Despawn the objects, except for the player, within radius tiles of
+   a point in the window. */
+#define BLAST_RADIUS 5.0f
+
+static void
+despawn_objects_around(int window_x, int window_y)
+{
+        object_handle *victims;
+        int *found;
+        int count;
+        int n = 0;
+        float x, y;
+
+        window_to_map(window_x, window_y, &x, &y);
+        found = malloc(obj_count * sizeof(int));
+        count = find_objects_in_radius(x, y, BLAST_RADIUS, found, obj_count);
+
+        victims = malloc(count * sizeof(object_handle));
+        for (int i = 0; i < count; ++i)
+                if (objects.type[found[i]] == OTHER)
+                        victims[n++] = objects.handle[found[i]];
+
+        despawn_objects(victims, n);
+        free(victims);
+        free(found);
+}
+
+/* Scatter copies of the non-player objects over the map, wandering
+   around at up to CROWD_SPEED tiles per second. */
+#define CROWD_SPEED 2.0f
+
+static void
+spawn_crowd(int count)
+{
+        struct object *crowd;
+
+        if (count == 0)
+                return;
+
+        crowd = malloc(count * sizeof(struct object));
+        for (int i = 0; i < count; ++i) {
+                crowd[i] = initial_objects[i % 2 ? 2 : 0];
+                crowd[i].x = (float) rand() / RAND_MAX * map_width;
+                crowd[i].y = (float) rand() / RAND_MAX * map_height;
+                crowd[i].vx = ((float) rand() / RAND_MAX * 2 - 1) * CROWD_SPEED;
+                crowd[i].vy = ((float) rand() / RAND_MAX * 2 - 1) * CROWD_SPEED;
+        }
+
+        spawn_objects(crowd, count);
+        free(crowd);
+}
+
+/* Upload the sprite table for the object shader: two texels per
+   sprite, holding its texture rectangle and its size and base. */
+static void
+init_object_sprites(void)
+{
+        int count = sizeof(object_sprites) / sizeof(object_sprites[0]);
+        const struct object_sprite *sprite;
+        float *table;
+        float *base;
+
+        table = malloc(count * 8 * sizeof(GLfloat));
+        for (int i = 0; i < count; ++i) {
+                sprite = &object_sprites[i];
+                base = table + 8 * i;
+                base[0] = sprite->texture_s;
+                base[1] = sprite->texture_t;
+                base[2] = sprite->texture_s + sprite->texture_width;
+                base[3] = sprite->texture_t + sprite->texture_height;
+                base[4] = sprite->width;
+                base[5] = sprite->height;
+                base[6] = sprite->base_y;
+                base[7] = 0.0f;
+        }
+
+        glGenBuffers(1, &obj_sprite_buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, obj_sprite_buffer);
+        glBufferData(GL_TEXTURE_BUFFER,
+                     count * 8 * sizeof(GLfloat),
+                     table,
+                     GL_STATIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+        free(table);
+
+        /* The table stays bound to texture unit 7. */
+        glGenTextures(1, &obj_sprite_texture);
+        glActiveTexture(GL_TEXTURE7);
+        glBindTexture(GL_TEXTURE_BUFFER, obj_sprite_texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, obj_sprite_buffer);
+        glActiveTexture(GL_TEXTURE0);
+}
+
+/* Upload the clip table for the object shader: a texel per clip,
+   holding its first sprite, frame count, frame duration and mode. */
+static void
+init_object_clips(void)
+{
+        int count = sizeof(object_clips) / sizeof(object_clips[0]);
+        int sprite_count = sizeof(object_sprites) / sizeof(object_sprites[0]);
+        const struct object_clip *clip;
+        GLushort *table;
+
+        table = malloc(count * 4 * sizeof(GLushort));
+        for (int i = 0; i < count; ++i) {
+                clip = &object_clips[i];
+                if (i > 0 &&
+                    (clip->sprite < 0 || clip->frames < 1 ||
+                     clip->sprite + clip->frames > sprite_count ||
+                     clip->duration < 1 || clip->duration > 0xffff))
+                {
+                        printf("Invalid object clip %d\n", i);
+                        exit(1);
+                }
+
+                table[4 * i] = clip->sprite;
+                table[4 * i + 1] = clip->frames;
+                table[4 * i + 2] = clip->duration;
+                table[4 * i + 3] = clip->mode;
+        }
+
+        glGenBuffers(1, &obj_clip_buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, obj_clip_buffer);
+        glBufferData(GL_TEXTURE_BUFFER,
+                     count * 4 * sizeof(GLushort),
+                     table,
+                     GL_STATIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+        free(table);
+
+        /* The table stays bound to texture unit 8. */
+        glGenTextures(1, &obj_clip_texture);
+        glActiveTexture(GL_TEXTURE8);
+        glBindTexture(GL_TEXTURE_BUFFER, obj_clip_texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA16UI, obj_clip_buffer);
+        glActiveTexture(GL_TEXTURE0);
+}
+
+static void
+init_object_grid(void)
+{
+        int count = sizeof(object_sprites) / sizeof(object_sprites[0]);
+
+        obj_grid_w = (map_width + OBJ_GRID_CELL - 1) / OBJ_GRID_CELL;
+        obj_grid_h = (map_height + OBJ_GRID_CELL - 1) / OBJ_GRID_CELL;
+        obj_grid = malloc(obj_grid_w * obj_grid_h * sizeof(int));
+        if (!obj_grid) {
+                printf("Could not allocate the object grid.\n");
+                exit(1);
+        }
+        for (int i = 0; i < obj_grid_w * obj_grid_h; ++i)
+                obj_grid[i] = -1;
+
+        for (int i = 0; i < count; ++i) {
+                obj_grid_reach_x = fmaxf(obj_grid_reach_x,
+                                         object_sprites[i].width);
+                obj_grid_reach_y = fmaxf(obj_grid_reach_y,
+                                         object_sprites[i].height);
+        }
+}
+
+static void
+init_objects(void)
+{
+        object_program = load_shader_program("obj-vertex-shader.glsl",
+                                             "obj-fragment-shader.glsl");
+        init_object_sprites();
+        init_object_clips();
+        init_object_grid();
+
+        /* Vertex data are actually only the vertex indices. 0, 1, 2,
+           and 3 being the bottom-left, top-left, top-right and
+           bottom-right corners of the quad. */
+        int vertex_data[] = {
+                0, 1, 3, /* triangle 1 */
+                1, 2, 3, /* triangle 2 */
+        };
+
+        glGenVertexArrays(1, &object_vao);
+        glGenBuffers(1, &object_vbo);
+
+        glBindVertexArray(object_vao);
+
+        glBindBuffer(GL_ARRAY_BUFFER, object_vbo);
+        glBufferData(GL_ARRAY_BUFFER,
+                     sizeof(vertex_data),
+                     vertex_data,
+                     GL_STATIC_DRAW);
+
+        GLint index_attr = glGetAttribLocation(object_program, "index");
+        glVertexAttribIPointer(index_attr, 1, GL_INT, 1 * sizeof(int),
+                               (void *) 0);
+        glEnableVertexAttribArray(index_attr);
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        /* The instance attributes are pointed at the instance buffer on
+           each upload, at the region of the ring it went to. */
+        obj_position_attr = glGetAttribLocation(object_program,
+                                                "obj_position");
+        glEnableVertexAttribArray(obj_position_attr);
+        glVertexAttribDivisor(obj_position_attr, 1);
+
+        obj_sprite_attr = glGetAttribLocation(object_program, "obj_sprite");
+        glEnableVertexAttribArray(obj_sprite_attr);
+        glVertexAttribDivisor(obj_sprite_attr, 1);
+
+        obj_bits_attr = glGetAttribLocation(object_program, "obj_bits");
+        glEnableVertexAttribArray(obj_bits_attr);
+        glVertexAttribDivisor(obj_bits_attr, 1);
+
+        obj_clip_start_attr = glGetAttribLocation(object_program,
+                                                  "obj_clip_start");
+        glEnableVertexAttribArray(obj_clip_start_attr);
+        glVertexAttribDivisor(obj_clip_start_attr, 1);
+
+        /* Unbind VAO */
+        glBindVertexArray(0);
+
+        if (SDL_GL_ExtensionSupported("GL_ARB_buffer_storage"))
+                buffer_storage = SDL_GL_GetProcAddress("glBufferStorage");
+
+        have_avx = SDL_HasAVX();
+        for (int i = 0; i < sizeof(initial_objects) / sizeof(initial_objects[0]); ++i) {
+                object_handle handle = spawn_object(&initial_objects[i]);
+                if (initial_objects[i].type == PLAYER)
+                        player = handle;
+        }
+        spawn_crowd(crowd_size);
+        update_object_data();
+
+        int max_y_uniform = glGetUniformLocation(object_program,
+                                                 "max_y");
+        int sprites_uniform = glGetUniformLocation(object_program,
+                                                   "sprites");
+        int clips_uniform = glGetUniformLocation(object_program, "clips");
+        int tints_uniform = glGetUniformLocation(object_program, "tints");
+        obj_time_uniform = glGetUniformLocation(object_program, "time");
+        obj_translucent_uniform = glGetUniformLocation(object_program,
+                                                       "translucent");
+
+        glUseProgram(object_program);
+        glUniform1f(max_y_uniform, map_height);
+        glUniform1i(sprites_uniform, 7);
+        glUniform1i(clips_uniform, 8);
+        glUniform4fv(tints_uniform,
+                     sizeof(object_tints) / sizeof(object_tints[0]),
+                     object_tints[0]);
+        glUseProgram(0);
+}
+
+static void
+init_tile_table(void)
+{
+        int columns = texture_w / UNIT_SIZE;
+        int rows = texture_h / UNIT_SIZE;
+        float *table;
+        float *base;
+
+        tile_count = columns * rows;
+        table = malloc(tile_count * 4 * sizeof(GLfloat));
+
+        /* Build a table of texture coordinates for each sprite in the
+           sheet, so that map tiles only need to store a tile index.
+           Each entry consists of the bottom-left and top-right
+           texture coordinates of the sprite. Since the texture is
+           flipped vertically, the first row of sprites is at the top
+           of the texture. */
+        for (int i = 0; i < tile_count; ++i) {
+                base = table + 4 * i;
+                base[0] = (float) (i % columns) / columns;
+                base[1] = 1.0f - (float) (i / columns + 1) / rows;
+                base[2] = (float) (i % columns + 1) / columns;
+                base[3] = 1.0f - (float) (i / columns) / rows;
+        }
+
+        glGenBuffers(1, &tile_table_buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, tile_table_buffer);
+        glBufferData(GL_TEXTURE_BUFFER,
+                     tile_count * 4 * sizeof(GLfloat),
+                     table,
+                     GL_STATIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+        free(table);
+
+        /* The table is accessed through a buffer texture which stays
+           bound to texture unit 1. */
+        glGenTextures(1, &tile_table_texture);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_BUFFER, tile_table_texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, tile_table_buffer);
+        glActiveTexture(GL_TEXTURE0);
+}
+
+static void
+init_sprite_colors(void)
+{
+        int columns = texture_w / UNIT_SIZE;
+        unsigned char *img;
+        unsigned char *texel;
+        unsigned int sum[4];
+        int x0, y0;
+
+        img = malloc(texture_w * texture_h * 4);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, img);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        /* Average color of each sprite, with premultiplied alpha. The
+           texture rows are bottom to top. */
+        sprite_colors = malloc(tile_count * sizeof(*sprite_colors));
+        for (int i = 0; i < tile_count; ++i) {
+                x0 = i % columns * UNIT_SIZE;
+                y0 = texture_h - (i / columns + 1) * UNIT_SIZE;
+                memset(sum, 0, sizeof(sum));
+
+                for (int y = y0; y < y0 + UNIT_SIZE; ++y) {
+                        for (int x = x0; x < x0 + UNIT_SIZE; ++x) {
+                                texel = img + 4 * (y * texture_w + x);
+                                for (int c = 0; c < 3; ++c)
+                                        sum[c] += texel[c] * texel[3] / 255;
+                                sum[3] += texel[3];
+                        }
+                }
+
+                for (int c = 0; c < 4; ++c)
+                        sprite_colors[i][c] = sum[c] / (UNIT_SIZE * UNIT_SIZE);
+        }
+
+        free(img);
+}
+
+/* Clear the corner bits of a neighbor mask whose edges are not both
+   set. */
+static int
+blob_mask(int mask)
+{
+        int result = mask & 15;
+
+        if ((mask & NEIGHBOR_NE) && (mask & NEIGHBOR_N) && (mask & NEIGHBOR_E))
+                result |= NEIGHBOR_NE;
+        if ((mask & NEIGHBOR_SE) && (mask & NEIGHBOR_S) && (mask & NEIGHBOR_E))
+                result |= NEIGHBOR_SE;
+        if ((mask & NEIGHBOR_SW) && (mask & NEIGHBOR_S) && (mask & NEIGHBOR_W))
+                result |= NEIGHBOR_SW;
+        if ((mask & NEIGHBOR_NW) && (mask & NEIGHBOR_N) && (mask & NEIGHBOR_W))
+                result |= NEIGHBOR_NW;
+
+        return result;
+}
+
+static void
+init_autotiling(void)
+{
+        int variants = 0;
+
+        sprite_terrain = malloc(tile_count);
+        memset(sprite_terrain, -1, tile_count);
+
+        /* Number the distinct masks of 8-neighbor sets in increasing
+           order, then map every other mask to its number. */
+        for (int i = 0; i < 256; ++i) {
+                if (blob_mask(i) == i)
+                        blob_variants[i] = variants++;
+        }
+
+        for (int i = 0; i < 256; ++i)
+                blob_variants[i] = blob_variants[blob_mask(i)];
+}
+
+/* Add an autotile set starting at the given sprite, depending on 4 or
+   8 neighbors. Returns the terrain number of the set. */
+static int
+add_autotile(int base, int neighbors)
+{
+        int variants = neighbors == 8 ? 47 : 16;
+
+        if (autotile_count == MAX_AUTOTILES ||
+            (neighbors != 4 && neighbors != 8) ||
+            base < 0 || base + variants > tile_count)
+        {
+                printf("Invalid autotile set at sprite %d\n", base);
+                exit(1);
+        }
+
+        autotiles[autotile_count].base = base;
+        autotiles[autotile_count].neighbors = neighbors;
+        for (int i = 0; i < variants; ++i)
+                sprite_terrain[base + i] = autotile_count;
+
+        return autotile_count++;
+}
+
+static void
+init_tile_anims(void)
+{
+        struct tile_anim *anims;
+
+        /* Initially no sprite is animated, i.e. all of them have a
+           single frame. */
+        anims = malloc(tile_count * sizeof(struct tile_anim));
+        for (int i = 0; i < tile_count; ++i) {
+                anims[i].frames = 1;
+                anims[i].duration = 1;
+                anims[i].stride = 0;
+                anims[i].unused = 0;
+        }
+
+        glGenBuffers(1, &tile_anim_buffer);
+        glBindBuffer(GL_TEXTURE_BUFFER, tile_anim_buffer);
+        glBufferData(GL_TEXTURE_BUFFER,
+                     tile_count * sizeof(struct tile_anim),
+                     anims,
+                     GL_STATIC_DRAW);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+        free(anims);
+
+        /* Like the tile table, the animation table is accessed
+           through a buffer texture, bound to texture unit 4. */
+        glGenTextures(1, &tile_anim_texture);
+        glActiveTexture(GL_TEXTURE4);
+        glBindTexture(GL_TEXTURE_BUFFER, tile_anim_texture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA16UI, tile_anim_buffer);
+        glActiveTexture(GL_TEXTURE0);
+}
+
+/* Animate the given sprite: it shows the given number of frames, each
+   for duration milliseconds, the sprites of consecutive frames being
+   stride apart in the sheet. */
+static void
+set_tile_anim(int sprite, int frames, int duration, int stride)
+{
+        struct tile_anim anim;
+
+        if (sprite < 0 || frames < 1 || frames > 0xffff ||
+            duration < 1 || duration > 0xffff || stride < 0 ||
+            sprite + (frames - 1) * stride >= tile_count)
+        {
+                printf("Invalid animation for sprite %d\n", sprite);
+                exit(1);
+        }
+
+        anim.frames = frames;
+        anim.duration = duration;
+        anim.stride = stride;
+        anim.unused = 0;
+
+        glBindBuffer(GL_TEXTURE_BUFFER, tile_anim_buffer);
+        glBufferSubData(GL_TEXTURE_BUFFER,
+                        sprite * sizeof(struct tile_anim),
+                        sizeof(struct tile_anim),
+                        &anim);
+        glBindBuffer(GL_TEXTURE_BUFFER, 0);
+}
+
+static unsigned int
+chunk_hash_index(int cx, int cy)
+{
+        return ((unsigned int) cx * 73856093u ^
+                (unsigned int) cy * 19349663u) % chunk_hash_size;
+}
+
+static struct chunk *
+find_chunk(int cx, int cy)
+{
+        struct chunk *chunk = chunk_hash[chunk_hash_index(cx, cy)];
+
+        while (chunk && (chunk->cx != cx || chunk->cy != cy))
+                chunk = chunk->hash_next;
+
+        return chunk;
+}
+
+static void
+lru_remove(struct chunk *chunk)
+{
+        if (chunk->lru_prev)
+                chunk->lru_prev->lru_next = chunk->lru_next;
+        else
+                lru_head = chunk->lru_next;
+
+        if (chunk->lru_next)
+                chunk->lru_next->lru_prev = chunk->lru_prev;
+        else
+                lru_tail = chunk->lru_prev;
+}
+
+static void
+lru_push_front(struct chunk *chunk)
+{
+        chunk->lru_prev = NULL;
+        chunk->lru_next = lru_head;
+        if (lru_head)
+                lru_head->lru_prev = chunk;
+        else
+                lru_tail = chunk;
+        lru_head = chunk;
+}
+
+static void
+set_chunk_slot_texel(const struct chunk *chunk, GLushort value)
+{
+        glActiveTexture(GL_TEXTURE3);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, chunk->cx, chunk->cy, 1, 1,
+                        GL_RED_INTEGER, GL_UNSIGNED_SHORT, &value);
+        glActiveTexture(GL_TEXTURE0);
+}
+
+static void
+free_chunk(struct chunk *chunk)
+{
+        struct chunk **p = &chunk_hash[chunk_hash_index(chunk->cx,
+                                                         chunk->cy)];
+
+        while (*p != chunk)
+                p = &(*p)->hash_next;
+        *p = chunk->hash_next;
+
+        lru_remove(chunk);
+
+        if (map_mode == MAP_MODE_TEXTURE && chunk->state == CHUNK_RESIDENT)
+                set_chunk_slot_texel(chunk, 0);
+
+        chunk->state = CHUNK_FREE;
+        chunk->hash_next = free_chunks;
+        free_chunks = chunk;
+}
+
+static void
+remove_from_load_queue(struct chunk *chunk)
+{
+        for (int i = 0; i < load_queue_len; ++i) {
+                if (load_queue[i] == chunk) {
+                        memmove(&load_queue[i], &load_queue[i + 1],
+                                (load_queue_len - i - 1) * sizeof(struct chunk *));
+                        --load_queue_len;
+                        return;
+                }
+        }
+}
+
+/* Find a chunk to reuse, either from the free list or by evicting the
+   least recently wanted chunk that is not being loaded and has not been
+   wanted in the current frame. Returns NULL if there is none. */
+static struct chunk *
+alloc_chunk(void)
+{
+        struct chunk *chunk = free_chunks;
+
+        if (chunk) {
+                free_chunks = chunk->hash_next;
+                return chunk;
+        }
+
+        SDL_LockMutex(loader_mutex);
+        for (chunk = lru_tail; chunk; chunk = chunk->lru_prev) {
+                if (chunk->last_wanted == frame_number) {
+                        /* Everything from here on is wanted. */
+                        chunk = NULL;
+                        break;
+                }
+
+                if (chunk->state == CHUNK_QUEUED) {
+                        remove_from_load_queue(chunk);
+                        break;
+                }
+
+                if (chunk->state == CHUNK_RESIDENT && !chunk->modified)
+                        break;
+        }
+        SDL_UnlockMutex(loader_mutex);
+
+        if (chunk) {
+                free_chunk(chunk);
+                free_chunks = chunk->hash_next;
+        }
+
+        return chunk;
+}
+
+/* Size of the chunks in the given column and row. */
+static int
+chunk_width(int cx)
+{
+        int width = map_width - cx * CHUNK_SIZE;
+
+        return width > CHUNK_SIZE ? CHUNK_SIZE : width;
+}
+
+static int
+chunk_height(int cy)
+{
+        int height = map_height - cy * CHUNK_SIZE;
+
+        return height > CHUNK_SIZE ? CHUNK_SIZE : height;
+}
+
+/* Mark the chunk at the given chunk coordinates as wanted in this
+   frame, and queue it for loading if it is not in memory yet. */
+static void
+want_chunk(int cx, int cy)
+{
+        struct chunk *chunk;
+        unsigned int h;
+
+        chunk = find_chunk(cx, cy);
+        if (chunk) {
+                chunk->last_wanted = frame_number;
+                lru_remove(chunk);
+                lru_push_front(chunk);
+                return;
+        }
+
+        chunk = alloc_chunk();
+        if (!chunk)
+                return;
+
+        chunk->cx = cx;
+        chunk->cy = cy;
+        chunk->width = chunk_width(cx);
+        chunk->height = chunk_height(cy);
+        chunk->last_wanted = frame_number;
+        chunk->modified = 0;
+        chunk->dirty_count = 0;
+
+        h = chunk_hash_index(cx, cy);
+        chunk->hash_next = chunk_hash[h];
+        chunk_hash[h] = chunk;
+        lru_push_front(chunk);
+
+        SDL_LockMutex(loader_mutex);
+        chunk->state = CHUNK_QUEUED;
+        load_queue[load_queue_len++] = chunk;
+        SDL_CondSignal(loader_cond);
+        SDL_UnlockMutex(loader_mutex);
+}
+
+static void
+want_chunks(int cx0, int cy0, int cx1, int cy1)
+{
+        if (cx0 < 0)
+                cx0 = 0;
+        if (cy0 < 0)
+                cy0 = 0;
+        if (cx1 >= chunks_w)
+                cx1 = chunks_w - 1;
+        if (cy1 >= chunks_h)
+                cy1 = chunks_h - 1;
+
+        for (int cy = cy0; cy <= cy1; ++cy)
+                for (int cx = cx0; cx <= cx1; ++cx)
+                        want_chunk(cx, cy);
+}
+
+static Uint32
+read_le32(const unsigned char *p)
+{
+        return p[0] | p[1] << 8 | p[2] << 16 | (Uint32) p[3] << 24;
+}
+
+static int
+decode_rle(const unsigned char *data, Uint32 size, tile_t *tiles, int count)
+{
+        const unsigned char *end = data + size;
+        tile_t tile;
+        int run;
+
+        while (end - data >= 4) {
+                run = data[0] | data[1] << 8;
+                tile = data[2] | data[3] << 8;
+                data += 4;
+
+                if (run > count)
+                        return 0;
+                for (int i = 0; i < run; ++i)
+                        tiles[i] = tile;
+                tiles += run;
+                count -= run;
+        }
+
+        return data == end && count == 0;
+}
+
+/* Returns the tiles of the given chunk: a pointer into the world map,
+   or buf filled in with them for generated worlds, empty and compressed
+   chunks. */
+static tile_t *
+get_chunk_tiles(int cx, int cy, int width, int height, tile_t *buf)
+{
+        int layer_tiles = width * height;
+        int tiles_size = map_layers * layer_tiles * sizeof(tile_t);
+        const unsigned char *entry;
+        Uint64 offset;
+        Uint32 size;
+        Uint32 encoding;
+        int ok;
+
+        if (!world_map) {
+                for (int i = 0; i < layer_tiles; ++i)
+                        buf[i] = MAKE_TILE(0, TILE_GROUND);
+                for (int i = layer_tiles; i < map_layers * layer_tiles; ++i)
+                        buf[i] = MAKE_TILE(i / layer_tiles, TILE_NONE);
+                return buf;
+        }
+
+        entry = world_directory + (cy * chunks_w + cx) * WFMAP_DIR_ENTRY_SIZE;
+        size = read_le32(entry + 8);
+        if (size == 0) {
+                for (int i = 0; i < map_layers * layer_tiles; ++i)
+                        buf[i] = MAKE_TILE(i / layer_tiles, TILE_NONE);
+                return buf;
+        }
+
+        offset = read_le32(entry) | (Uint64) read_le32(entry + 4) << 32;
+
+        encoding = read_le32(entry + 12);
+        if (encoding != WFMAP_ENCODING_RAW) {
+                if (encoding == WFMAP_ENCODING_RLE) {
+                        ok = decode_rle(world_map + offset, size, buf,
+                                        map_layers * layer_tiles);
+                } else {
+                        ok = wflz_decompress(world_map + offset, size, buf,
+                                             tiles_size) == tiles_size;
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+                        for (int i = 0; i < map_layers * layer_tiles; ++i)
+                                buf[i] = SDL_SwapLE16(buf[i]);
+#endif
+                }
+
+                if (!ok) {
+                        printf("Corrupt chunk (%d, %d) in world file: %s\n",
+                               cx, cy, world_filename);
+                        exit(1);
+                }
+                return buf;
+        }
+
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        /* The tiles cannot be used in place. */
+        for (int i = 0; i < map_layers * layer_tiles; ++i)
+                buf[i] = SDL_SwapLE16(((tile_t *) (world_map + offset))[i]);
+        return buf;
+#else
+        return (tile_t *) (world_map + offset);
+#endif
+}
+
+static void
+load_chunk_tiles(struct chunk *chunk)
+{
+        volatile unsigned char touch;
+        unsigned char *p;
+        size_t size;
+
+        chunk->tiles = get_chunk_tiles(chunk->cx, chunk->cy,
+                                       chunk->width, chunk->height,
+                                       chunk->buffer);
+        if (chunk->tiles == chunk->buffer)
+                return;
+
+        /* Take the page faults for the chunk here rather than on the
+           main thread when uploading it. */
+        p = (unsigned char *) chunk->tiles;
+        size = map_layers * chunk->width * chunk->height * sizeof(tile_t);
+        for (size_t i = 0; i < size; i += WFMAP_PAGE_SIZE)
+                touch = p[i];
+        (void) touch;
+}
+
+/* Fill in the overview colors of the tiles of a chunk, blending the
+   colors of all its layers, into the rows of pixels starting at the
+   given one. */
+static void
+chunk_overview(const tile_t *tiles, int width, int height,
+               unsigned char *pixels, int stride)
+{
+        const unsigned char *color;
+        unsigned char *pixel;
+        int sprite;
+
+        for (int y = 0; y < height; ++y) {
+                for (int x = 0; x < width; ++x) {
+                        pixel = pixels + 4 * (y * stride + x);
+                        memset(pixel, 0, 4);
+
+                        for (int layer = 0; layer < map_layers; ++layer) {
+                                sprite = TILE_SPRITE(tiles[width * (height * layer + y) + x]);
+                                if (sprite == TILE_NONE || sprite >= tile_count)
+                                        continue;
+
+                                color = sprite_colors[sprite];
+                                for (int c = 0; c < 4; ++c)
+                                        pixel[c] = color[c] +
+                                                pixel[c] * (255 - color[3]) / 255;
+                        }
+                }
+        }
+}
+
+/* Job filling in the overview pixels *data points to for chunk rows
+   [start, end). */
+static void
+overview_rows(void *data, int start, int end)
+{
+        unsigned char *pixels = data;
+        tile_t *tiles;
+        int width, height;
+        int quit;
+
+        tiles = malloc(map_layers * CHUNK_TILES * sizeof(tile_t));
+
+        for (int cy = start; cy < end; ++cy) {
+                SDL_LockMutex(loader_mutex);
+                quit = loader_quit;
+                SDL_UnlockMutex(loader_mutex);
+                if (quit)
+                        break;
+
+                for (int cx = 0; cx < chunks_w; ++cx) {
+                        width = chunk_width(cx);
+                        height = chunk_height(cy);
+
+                        chunk_overview(get_chunk_tiles(cx, cy, width, height,
+                                                       tiles),
+                                       width, height,
+                                       pixels + 4 * ((size_t) cy * CHUNK_SIZE * map_width +
+                                                     cx * CHUNK_SIZE),
+                                       map_width);
+                }
+        }
+
+        free(tiles);
+}
+
+static int
+overview_main(void *data)
+{
+        unsigned char *pixels;
+
+        pixels = malloc((size_t) map_width * map_height * 4);
+        parallel_for(chunks_h, 1, overview_rows, pixels);
+
+        SDL_LockMutex(loader_mutex);
+        overview_pixels = pixels;
+        SDL_UnlockMutex(loader_mutex);
+
+        return 0;
+}
+
+static void
+update_chunk_overview(const struct chunk *chunk)
+{
+        unsigned char pixels[CHUNK_TILES * 4];
+
+        chunk_overview(chunk->tiles, chunk->width, chunk->height,
+                       pixels, chunk->width);
+
+        glActiveTexture(GL_TEXTURE6);
+        glTexSubImage2D(GL_TEXTURE_2D, 0,
+                        chunk->cx * CHUNK_SIZE, chunk->cy * CHUNK_SIZE,
+                        chunk->width, chunk->height,
+                        GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        glActiveTexture(GL_TEXTURE0);
+
+        overview_mips_dirty = 1;
+}
+
+/* Upload the overview once it is built, bringing it up to date with
+   the chunks edited in the meantime. */
+static void
+finish_overview(void)
+{
+        unsigned char *pixels;
+
+        SDL_LockMutex(loader_mutex);
+        pixels = overview_pixels;
+        SDL_UnlockMutex(loader_mutex);
+
+        if (!pixels)
+                return;
+
+        SDL_WaitThread(overview_thread, NULL);
+        overview_thread = NULL;
+
+        glActiveTexture(GL_TEXTURE6);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, map_width, map_height,
+                        GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+        glActiveTexture(GL_TEXTURE0);
+        free(pixels);
+
+        overview_ready = 1;
+        overview_mips_dirty = 1;
+
+        for (int i = 0; i < chunk_pool_size; ++i) {
+                if (chunk_pool[i].modified &&
+                    chunk_pool[i].state == CHUNK_RESIDENT)
+                        update_chunk_overview(&chunk_pool[i]);
+        }
+}
+
+/* Whether the map is drawn from the overview at the current zoom. */
+static int
+is_lod_view(void)
+{
+        return overview_texture && view_w > 0 &&
+                view_w / (cam_w * zoom) < LOD_TILE_PIXELS;
+}
+
+static int
+loader_main(void *data)
+{
+        struct chunk *chunk;
+
+        SDL_LockMutex(loader_mutex);
+        for (;;) {
+                while (!loader_quit && load_queue_len == 0)
+                        SDL_CondWait(loader_cond, loader_mutex);
+
+                if (loader_quit)
+                        break;
+
+                chunk = load_queue[0];
+                memmove(&load_queue[0], &load_queue[1],
+                        (load_queue_len - 1) * sizeof(struct chunk *));
+                --load_queue_len;
+                chunk->state = CHUNK_LOADING;
+                SDL_UnlockMutex(loader_mutex);
+
+                load_chunk_tiles(chunk);
+
+                SDL_LockMutex(loader_mutex);
+                chunk->state = CHUNK_LOADED;
+                loaded_queue[loaded_queue_len++] = chunk;
+        }
+        SDL_UnlockMutex(loader_mutex);
+
+        return 0;
+}
+
+static int
+is_layer_cached(int layer)
+{
+        return map_mode == MAP_MODE_CACHED &&
+                !(layers[layer].flags & LAYER_ANIMATED);
+}
+
+/* Mark the given rectangle of tiles of a layer to be drawn again in the
+   layer's cache. */
+static void
+invalidate_cache(int layer, int x0, int y0, int x1, int y1)
+{
+        struct layer_cache *cache = &layer_caches[layer];
+
+        if (cache->dirty_x0 >= cache->dirty_x1) {
+                cache->dirty_x0 = x0;
+                cache->dirty_y0 = y0;
+                cache->dirty_x1 = x1;
+                cache->dirty_y1 = y1;
+                return;
+        }
+
+        if (x0 < cache->dirty_x0)
+                cache->dirty_x0 = x0;
+        if (y0 < cache->dirty_y0)
+                cache->dirty_y0 = y0;
+        if (x1 > cache->dirty_x1)
+                cache->dirty_x1 = x1;
+        if (y1 > cache->dirty_y1)
+                cache->dirty_y1 = y1;
+}
+
+static void
+upload_chunk(struct chunk *chunk)
+{
+        int layer_tiles = chunk->width * chunk->height;
+        int slot_x, slot_y;
+
+        if (map_mode == MAP_MODE_TEXTURE) {
+                slot_x = chunk->slot % atlas_columns * CHUNK_SIZE;
+                slot_y = chunk->slot / atlas_columns * CHUNK_SIZE;
+
+                glActiveTexture(GL_TEXTURE2);
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, slot_x, slot_y, 0,
+                                chunk->width, chunk->height, map_layers,
+                                GL_RED_INTEGER, GL_UNSIGNED_SHORT,
+                                chunk->tiles);
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+                glActiveTexture(GL_TEXTURE0);
+
+                set_chunk_slot_texel(chunk, chunk->slot + 1);
+        } else {
+                glBindBuffer(GL_ARRAY_BUFFER, map_instance_vbo);
+                glBufferSubData(GL_ARRAY_BUFFER,
+                                chunk->slot * map_layers * CHUNK_TILES * sizeof(tile_t),
+                                map_layers * layer_tiles * sizeof(tile_t),
+                                chunk->tiles);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+
+        /* Caches might have been drawn without this chunk. */
+        for (int i = 0; i < map_layers; ++i) {
+                if (is_layer_cached(i))
+                        invalidate_cache(i,
+                                         chunk->cx * CHUNK_SIZE,
+                                         chunk->cy * CHUNK_SIZE,
+                                         chunk->cx * CHUNK_SIZE + chunk->width,
+                                         chunk->cy * CHUNK_SIZE + chunk->height);
+        }
+}
+
+/* Returns the sprite of the tile at the given map position and layer
+   (TILE_NONE if empty), or -1 if the chunk containing it is not in
+   memory. */
+static int
+get_tile(int x, int y, int layer)
+{
+        struct chunk *chunk;
+
+        if (x < 0 || y < 0 || x >= map_width || y >= map_height ||
+            layer < 0 || layer >= map_layers)
+                return -1;
+
+        chunk = find_chunk(x / CHUNK_SIZE, y / CHUNK_SIZE);
+        if (!chunk || chunk->state != CHUNK_RESIDENT)
+                return -1;
+
+        return TILE_SPRITE(chunk->tiles[chunk->width * (chunk->height * layer +
+                                                        y % CHUNK_SIZE) +
+                                        x % CHUNK_SIZE]);
+}
+
+/* Change the sprite of the tile at the given map position and layer.
+   The change is uploaded to the GPU at the end of the frame, along with
+   all other edits. Returns -1 if the chunk containing the tile is not
+   in memory. */
+static int
+set_tile(int x, int y, int layer, int sprite)
+{
+        struct chunk *chunk;
+        tile_t tile = MAKE_TILE(layer, sprite);
+        int i;
+
+        if (x < 0 || y < 0 || x >= map_width || y >= map_height ||
+            layer < 0 || layer >= map_layers)
+                return -1;
+
+        chunk = find_chunk(x / CHUNK_SIZE, y / CHUNK_SIZE);
+        if (!chunk || chunk->state != CHUNK_RESIDENT)
+                return -1;
+
+        i = chunk->width * (chunk->height * layer + y % CHUNK_SIZE) +
+                x % CHUNK_SIZE;
+        if (chunk->tiles[i] == tile)
+                return 0;
+
+        chunk->tiles[i] = tile;
+        chunk->modified = 1;
+
+        if (is_layer_cached(layer))
+                invalidate_cache(layer, x, y, x + 1, y + 1);
+
+        if (chunk->dirty[i / 64] & (1ull << i % 64))
+                return 0;
+
+        if (chunk->dirty_count++ == 0)
+                dirty_chunks[dirty_chunks_len++] = chunk;
+        chunk->dirty[i / 64] |= 1ull << i % 64;
+
+        return 0;
+}
+
+/* Returns the terrain of the tile at the given map position and layer,
+   -1 if it has none, or -2 if unknown (outside the map or not in
+   memory). */
+static int
+tile_terrain(int x, int y, int layer)
+{
+        int sprite = get_tile(x, y, layer);
+
+        if (sprite < 0)
+                return -2;
+        if (sprite == TILE_NONE || sprite >= tile_count)
+                return -1;
+
+        return sprite_terrain[sprite];
+}
+
+/* Pick the sprite of the tile at the given position and layer from its
+   autotile set, based on its neighbors. */
+static void
+autotile(int x, int y, int layer)
+{
+        static const int dx[] = { 0, 1, 0, -1, 1, 1, -1, -1 };
+        static const int dy[] = { 1, 0, -1, 0, 1, -1, -1, 1 };
+        int terrain, neighbor;
+        int mask = 0;
+
+        terrain = tile_terrain(x, y, layer);
+        if (terrain < 0)
+                return;
+
+        /* The neighbors in the order of the mask bits. */
+        for (int i = 0; i < autotiles[terrain].neighbors; ++i) {
+                neighbor = tile_terrain(x + dx[i], y + dy[i], layer);
+                if (neighbor == terrain || neighbor == -2)
+                        mask |= 1 << i;
+        }
+
+        if (autotiles[terrain].neighbors == 8)
+                mask = blob_variants[mask];
+
+        set_tile(x, y, layer, autotiles[terrain].base + mask);
+}
+
+/* Change the terrain of the tile at the given map position and layer,
+   and update the sprites of it and its neighbors to match. Only the
+   tiles actually changed are uploaded, at the end of the frame. Returns
+   -1 if the chunk containing the tile is not in memory. */
+static int
+set_terrain(int x, int y, int layer, int terrain)
+{
+        if (set_tile(x, y, layer, autotiles[terrain].base) < 0)
+                return -1;
+
+        for (int dy = -1; dy <= 1; ++dy) {
+                for (int dx = -1; dx <= 1; ++dx)
+                        autotile(x + dx, y + dy, layer);
+        }
+
+        return 0;
+}
+
+static void
+upload_tile_range(struct chunk *chunk, int first, int count)
+{
+        int x, y, n;
+
+        if (map_mode == MAP_MODE_TEXTURE) {
+                /* Ranges may span several rows of the chunk, which are
+                   not contiguous in the atlas. */
+                glActiveTexture(GL_TEXTURE2);
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+                while (count > 0) {
+                        x = first % chunk->width;
+                        y = first / chunk->width;
+                        n = chunk->width - x;
+                        if (n > count)
+                                n = count;
+
+                        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0,
+                                        chunk->slot % atlas_columns * CHUNK_SIZE + x,
+                                        chunk->slot / atlas_columns * CHUNK_SIZE +
+                                        y % chunk->height,
+                                        y / chunk->height,
+                                        n, 1, 1,
+                                        GL_RED_INTEGER, GL_UNSIGNED_SHORT,
+                                        chunk->tiles + first);
+                        first += n;
+                        count -= n;
+                }
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+                glActiveTexture(GL_TEXTURE0);
+        } else {
+                glBindBuffer(GL_ARRAY_BUFFER, map_instance_vbo);
+                glBufferSubData(GL_ARRAY_BUFFER,
+                                (chunk->slot * map_layers * CHUNK_TILES + first) *
+                                sizeof(tile_t),
+                                count * sizeof(tile_t),
+                                chunk->tiles + first);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+}
+
+/* Upload the tiles edited since the last frame. Runs of dirty tiles
+   are coalesced into as few uploads as possible, and heavily edited
+   chunks are uploaded in one go. */
+static void
+flush_tile_edits(void)
+{
+        struct chunk *chunk;
+        int tiles, first, last;
+
+        for (int c = 0; c < dirty_chunks_len; ++c) {
+                chunk = dirty_chunks[c];
+
+                tiles = map_layers * chunk->width * chunk->height;
+
+                if (chunk->dirty_count > tiles / CHUNK_REUPLOAD_FRACTION) {
+                        upload_chunk(chunk);
+                } else {
+                        first = -1;
+                        last = -1;
+                        for (int w = 0; w < (tiles + 63) / 64; ++w) {
+                                if (!chunk->dirty[w])
+                                        continue;
+
+                                for (int b = 0; b < 64; ++b) {
+                                        if (!(chunk->dirty[w] & (1ull << b)))
+                                                continue;
+
+                                        if (first >= 0 &&
+                                            64 * w + b - last > DIRTY_MERGE_GAP) {
+                                                upload_tile_range(chunk, first,
+                                                                  last - first + 1);
+                                                first = -1;
+                                        }
+
+                                        if (first < 0)
+                                                first = 64 * w + b;
+                                        last = 64 * w + b;
+                                }
+                        }
+                        upload_tile_range(chunk, first, last - first + 1);
+                }
+
+                if (overview_ready)
+                        update_chunk_overview(chunk);
+
+                memset(chunk->dirty, 0, (tiles + 63) / 64 * sizeof(Uint64));
+                chunk->dirty_count = 0;
+        }
+
+        dirty_chunks_len = 0;
+}
+
+/* Called once per frame to request the chunks around the camera, and
+   upload the ones the loader has finished with. */
+static void
+update_world(void)
+{
+        static float last_player_x, last_player_y;
+        static Uint32 last_move;
+        static int move_x, move_y;
+        int p = object_index(player);
+        float player_x = objects.x[p];
+        float player_y = objects.y[p];
+        struct chunk **loaded;
+        int loaded_len;
+        float x, y;
+        int cx0, cy0, cx1, cy1;
+        int n;
+
+        ++frame_number;
+
+        /* Track the direction the player is moving in. */
+        if (player_x != last_player_x || player_y != last_player_y) {
+                move_x = (player_x > last_player_x) - (player_x < last_player_x);
+                move_y = (player_y > last_player_y) - (player_y < last_player_y);
+                last_player_x = player_x;
+                last_player_y = player_y;
+                last_move = SDL_GetTicks();
+        } else if (SDL_GetTicks() - last_move > PREFETCH_TIMEOUT) {
+                move_x = 0;
+                move_y = 0;
+        }
+
+        if (!overview_ready)
+                finish_overview();
+
+        /* Visible chunks of all layers are requested first so that
+           they are loaded first, then the ones ahead of the player.
+           Nothing is needed when drawing from the overview. */
+        for (int prefetch = 0; prefetch <= 1; ++prefetch) {
+                if (is_lod_view())
+                        break;
+                if (prefetch && !move_x && !move_y)
+                        break;
+
+                for (int layer = 0; layer < map_layers; ++layer) {
+                        x = cam_x * layers[layer].parallax;
+                        y = cam_y * layers[layer].parallax;
+                        cx0 = floorf(x / CHUNK_SIZE) - CHUNK_MARGIN;
+                        cy0 = floorf(y / CHUNK_SIZE) - CHUNK_MARGIN;
+                        cx1 = floorf((x + cam_w * zoom) / CHUNK_SIZE) + CHUNK_MARGIN;
+                        cy1 = floorf((y + cam_h * zoom) / CHUNK_SIZE) + CHUNK_MARGIN;
+
+                        if (prefetch) {
+                                cx0 += move_x * CHUNK_PREFETCH;
+                                cy0 += move_y * CHUNK_PREFETCH;
+                                cx1 += move_x * CHUNK_PREFETCH;
+                                cy1 += move_y * CHUNK_PREFETCH;
+                        }
+
+                        want_chunks(cx0, cy0, cx1, cy1);
+                }
+        }
+
+        SDL_LockMutex(loader_mutex);
+
+        /* Drop requests for chunks that are not wanted anymore. */
+        n = 0;
+        for (int i = 0; i < load_queue_len; ++i) {
+                if (load_queue[i]->last_wanted == frame_number)
+                        load_queue[n++] = load_queue[i];
+                else
+                        free_chunk(load_queue[i]);
+        }
+        load_queue_len = n;
+
+        /* Swap the queue with an empty list, so that the uploads can
+           be done without holding the lock. */
+        loaded = loaded_queue;
+        loaded_len = loaded_queue_len;
+        loaded_queue = upload_list;
+        loaded_queue_len = 0;
+        upload_list = loaded;
+
+        SDL_UnlockMutex(loader_mutex);
+
+        for (int i = 0; i < loaded_len; ++i) {
+                upload_chunk(loaded[i]);
+                loaded[i]->state = CHUNK_RESIDENT;
+        }
+
+        flush_tile_edits();
+}
+
+static void
+world_error(const char *message)
+{
+        printf("%s: %s\n", message, world_filename);
+        exit(1);
+}
+
+static void
+open_world(void)
+{
+        const unsigned char *header;
+        const unsigned char *entry;
+        struct stat st;
+        Uint32 parallax;
+        Uint64 directory_offset, offset;
+        Uint32 encoding, raw_size;
+        size_t tables_size;
+        int anim_count;
+        int autotile_count;
+        int fd;
+
+        if (!world_filename) {
+                if (map_width == 0) {
+                        map_width = MAP_WIDTH;
+                        map_height = MAP_HEIGHT;
+                }
+
+                /* Generated worlds only have a ground layer. */
+                map_layers = 1;
+                layers[0].parallax = 1.0f;
+                layers[0].flags = 0;
+
+                chunks_w = (map_width + CHUNK_SIZE - 1) / CHUNK_SIZE;
+                chunks_h = (map_height + CHUNK_SIZE - 1) / CHUNK_SIZE;
+                return;
+        }
+
+        fd = open(world_filename, O_RDONLY);
+        if (fd < 0)
+                world_error("Could not open world file");
+
+        if (fstat(fd, &st) < 0 || st.st_size < WFMAP_HEADER_SIZE)
+                world_error("Not a world file");
+
+        world_map_size = st.st_size;
+        world_map = mmap(NULL, world_map_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (world_map == MAP_FAILED)
+                world_error("Could not map world file");
+
+        header = world_map;
+        if (memcmp(header, WFMAP_MAGIC, 4) != 0)
+                world_error("Not a world file");
+        if (read_le32(header + 4) != WFMAP_VERSION)
+                world_error("Unsupported world file version");
+
+        map_width = read_le32(header + 8);
+        map_height = read_le32(header + 12);
+        if (map_width < 1 || map_height < 1)
+                world_error("Invalid world file map size");
+        if (read_le32(header + 16) != CHUNK_SIZE) {
+                printf("World file chunk size is not %d: %s\n",
+                       CHUNK_SIZE, world_filename);
+                exit(1);
+        }
+
+        map_layers = read_le32(header + 20);
+        if (map_layers < 1 || map_layers > MAX_LAYERS) {
+                printf("World file must have 1 to %d layers: %s\n",
+                       MAX_LAYERS, world_filename);
+                exit(1);
+        }
+
+        anim_count = read_le32(header + 24);
+        autotile_count = read_le32(header + 28);
+        tables_size = (size_t) map_layers * WFMAP_LAYER_SIZE +
+                (size_t) anim_count * WFMAP_ANIM_SIZE +
+                (size_t) autotile_count * WFMAP_AUTOTILE_SIZE;
+        if (anim_count < 0 || autotile_count < 0 ||
+            world_map_size - WFMAP_HEADER_SIZE < tables_size)
+                world_error("Could not read world file");
+
+        entry = header + WFMAP_HEADER_SIZE;
+        for (int i = 0; i < map_layers; ++i, entry += WFMAP_LAYER_SIZE) {
+                parallax = read_le32(entry);
+                memcpy(&layers[i].parallax, &parallax, sizeof(float));
+                layers[i].flags = read_le32(entry + 4);
+        }
+
+        for (int i = 0; i < anim_count; ++i, entry += WFMAP_ANIM_SIZE)
+                set_tile_anim(read_le32(entry), read_le32(entry + 4),
+                              read_le32(entry + 8), read_le32(entry + 12));
+
+        for (int i = 0; i < autotile_count; ++i, entry += WFMAP_AUTOTILE_SIZE)
+                add_autotile(read_le32(entry), read_le32(entry + 4));
+
+        /* Check the whole directory up front, so that chunks can be
+           used without any further checks. */
+        chunks_w = (map_width + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        chunks_h = (map_height + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        directory_offset = read_le32(header + 32) |
+                (Uint64) read_le32(header + 36) << 32;
+        if (directory_offset > world_map_size ||
+            (world_map_size - directory_offset) / WFMAP_DIR_ENTRY_SIZE <
+            (Uint64) chunks_w * chunks_h)
+                world_error("Invalid world file chunk directory");
+
+        world_directory = world_map + directory_offset;
+        for (int cy = 0; cy < chunks_h; ++cy) {
+                for (int cx = 0; cx < chunks_w; ++cx) {
+                        entry = world_directory +
+                                (cy * chunks_w + cx) * WFMAP_DIR_ENTRY_SIZE;
+                        offset = read_le32(entry) |
+                                (Uint64) read_le32(entry + 4) << 32;
+                        if (read_le32(entry + 8) == 0)
+                                continue;
+
+                        encoding = read_le32(entry + 12);
+                        raw_size = map_layers * chunk_width(cx) *
+                                chunk_height(cy) * sizeof(tile_t);
+                        if (offset > world_map_size ||
+                            world_map_size - offset < read_le32(entry + 8) ||
+                            (encoding == WFMAP_ENCODING_RAW &&
+                             (read_le32(entry + 8) != raw_size ||
+                              offset % WFMAP_PAGE_SIZE != 0)) ||
+                            (encoding != WFMAP_ENCODING_RAW &&
+                             encoding != WFMAP_ENCODING_RLE &&
+                             encoding != WFMAP_ENCODING_LZ))
+                        {
+                                printf("Invalid chunk (%d, %d) in world "
+                                       "file: %s\n",
+                                       cx, cy, world_filename);
+                                exit(1);
+                        }
+                }
+        }
+}
+
+static void
+init_overview(void)
+{
+        GLint max_size;
+
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+        if (map_width > max_size || map_height > max_size) {
+                printf("Map too large for an overview, not drawing it "
+                       "when zoomed out.\n");
+                return;
+        }
+
+        /* The overview stays bound to texture unit 6. */
+        glGenTextures(1, &overview_texture);
+        glActiveTexture(GL_TEXTURE6);
+        glBindTexture(GL_TEXTURE_2D, overview_texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, map_width, map_height, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                        GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glActiveTexture(GL_TEXTURE0);
+}
+
+static void
+init_world(void)
+{
+        size_t chunk_cost;
+        tile_t *tiles;
+        Uint64 *dirty;
+
+        open_world();
+
+        /* Each chunk in memory costs its bookkeeping, tiles and dirty
+           bitmap on the CPU side, and another copy of its tiles on the
+           GPU. */
+        chunk_cost = sizeof(struct chunk) +
+                map_layers * CHUNK_TILES * (2 * sizeof(tile_t)) +
+                map_layers * CHUNK_TILES / 8;
+        chunk_pool_size = (size_t) chunk_memory * 1024 * 1024 / chunk_cost;
+        if (chunk_pool_size < 1) {
+                printf("Chunk memory cap too small.\n");
+                exit(1);
+        }
+
+        chunk_pool = malloc(chunk_pool_size * sizeof(struct chunk));
+        tiles = malloc(chunk_pool_size * map_layers * CHUNK_TILES * sizeof(tile_t));
+        dirty = calloc(chunk_pool_size * map_layers * CHUNK_TILES / 64,
+                       sizeof(Uint64));
+        for (int i = chunk_pool_size - 1; i >= 0; --i) {
+                chunk_pool[i].buffer = tiles + i * map_layers * CHUNK_TILES;
+                chunk_pool[i].dirty = dirty + i * map_layers * CHUNK_TILES / 64;
+                chunk_pool[i].last_drawn = 0;
+                chunk_pool[i].slot = i;
+                chunk_pool[i].state = CHUNK_FREE;
+                chunk_pool[i].hash_next = free_chunks;
+                free_chunks = &chunk_pool[i];
+        }
+
+        chunk_hash_size = 2 * chunk_pool_size;
+        chunk_hash = calloc(chunk_hash_size, sizeof(struct chunk *));
+
+        load_queue = malloc(chunk_pool_size * sizeof(struct chunk *));
+        loaded_queue = malloc(chunk_pool_size * sizeof(struct chunk *));
+        dirty_chunks = malloc(chunk_pool_size * sizeof(struct chunk *));
+        upload_list = malloc(chunk_pool_size * sizeof(struct chunk *));
+
+        init_overview();
+
+        loader_mutex = SDL_CreateMutex();
+        loader_cond = SDL_CreateCond();
+        loader_thread = SDL_CreateThread(loader_main, "chunk loader", NULL);
+        if (overview_texture)
+                overview_thread = SDL_CreateThread(overview_main, "overview",
+                                                   NULL);
+
+        printf("World: %dx%d tiles, %d layers, up to %d chunks in memory\n",
+               map_width, map_height, map_layers, chunk_pool_size);
+}
+
+static void
+quit_world(void)
+{
+        SDL_LockMutex(loader_mutex);
+        loader_quit = 1;
+        SDL_CondSignal(loader_cond);
+        SDL_UnlockMutex(loader_mutex);
+
+        SDL_WaitThread(loader_thread, NULL);
+        if (overview_thread)
+                SDL_WaitThread(overview_thread, NULL);
+
+        if (world_map)
+                munmap(world_map, world_map_size);
+}
+
+static void
+init_map_instances(void)
+{
+        /* One slot of CHUNK_TILES instances per layer for each chunk
+           that can be in memory. */
+        glGenBuffers(1, &map_instance_vbo);
+
+        glBindVertexArray(map_vao);
+
+        glBindBuffer(GL_ARRAY_BUFFER, map_instance_vbo);
+        glBufferData(GL_ARRAY_BUFFER,
+                     chunk_pool_size * map_layers * CHUNK_TILES * sizeof(tile_t),
+                     NULL,
+                     GL_DYNAMIC_DRAW);
+
+        map_tile_attr = glGetAttribLocation(map_program, "tile");
+        glEnableVertexAttribArray(map_tile_attr);
+        glVertexAttribIPointer(map_tile_attr, 1, GL_UNSIGNED_SHORT,
+                               sizeof(tile_t), (void *) 0);
+
+        /* Mark it as an instance attribute updated for each
+           instance */
+        glVertexAttribDivisor(map_tile_attr, 1);
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        glBindVertexArray(0);
+
+        map_chunk_origin_uniform = glGetUniformLocation(map_program,
+                                                        "chunk_origin");
+        map_chunk_size_uniform = glGetUniformLocation(map_program,
+                                                      "chunk_size");
+}
+
+static void
+init_map_texture(void)
+{
+        GLint max_size;
+        int atlas_rows;
+        GLushort *zeros;
+
+        /* In this mode the chunks in memory are stored in an atlas
+           texture, one texel per tile and one array layer per map
+           layer, and the fragment shader looks up the tiles under each
+           pixel. To find where a chunk is in
+           the atlas, another texture holds the slot number plus one of
+           every chunk of the map, or zero if the chunk is not in
+           memory. The textures stay bound to texture units 2 and
+           3. */
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+        atlas_columns = ceilf(sqrtf(chunk_pool_size));
+        atlas_rows = (chunk_pool_size + atlas_columns - 1) / atlas_columns;
+        if (atlas_columns * CHUNK_SIZE > max_size ||
+            chunks_w > max_size || chunks_h > max_size)
+        {
+                printf("Map too large for texture mode.\n");
+                exit(1);
+        }
+
+        glGenTextures(1, &map_texture);
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, map_texture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R16UI,
+                     atlas_columns * CHUNK_SIZE, atlas_rows * CHUNK_SIZE,
+                     map_layers, 0,
+                     GL_RED_INTEGER, GL_UNSIGNED_SHORT, NULL);
+
+        /* Integer textures cannot be filtered. */
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+        zeros = calloc(chunks_w * chunks_h, sizeof(GLushort));
+        glGenTextures(1, &chunk_slots_texture);
+        glActiveTexture(GL_TEXTURE3);
+        glBindTexture(GL_TEXTURE_2D, chunk_slots_texture);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_R16UI, chunks_w, chunks_h, 0,
+                     GL_RED_INTEGER, GL_UNSIGNED_SHORT, zeros);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glActiveTexture(GL_TEXTURE0);
+        free(zeros);
+
+        int map_tiles_uniform = glGetUniformLocation(map_program,
+                                                     "map_tiles");
+        int chunk_slots_uniform = glGetUniformLocation(map_program,
+                                                       "chunk_slots");
+        int map_size_uniform = glGetUniformLocation(map_program,
+                                                    "map_size");
+        int chunk_size_uniform = glGetUniformLocation(map_program,
+                                                      "chunk_size");
+        int atlas_columns_uniform = glGetUniformLocation(map_program,
+                                                         "atlas_columns");
+
+        glUseProgram(map_program);
+        glUniform1i(map_tiles_uniform, 2);
+        glUniform1i(chunk_slots_uniform, 3);
+        glUniform2i(map_size_uniform, map_width, map_height);
+        glUniform1i(chunk_size_uniform, CHUNK_SIZE);
+        glUniform1i(atlas_columns_uniform, atlas_columns);
+        glUseProgram(0);
+
+        map_layer_range_uniform = glGetUniformLocation(map_program,
+                                                       "layer_range");
+        map_depth_uniform = glGetUniformLocation(map_program, "depth");
+}
+
+/* Depth of the given layer; the deeper the layer, the further back
+   inside its depth band. */
+static float
+layer_depth(int layer)
+{
+        float band_start, band_size;
+
+        if (layers[layer].flags & LAYER_ABOVE_OBJECTS) {
+                band_start = 0.0f;
+                band_size = DEPTH_ABOVE_OBJECTS;
+        } else {
+                band_start = DEPTH_BELOW_OBJECTS;
+                band_size = 1.0f - DEPTH_BELOW_OBJECTS;
+        }
+
+        return band_start + band_size * (MAX_LAYERS - layer) / (MAX_LAYERS + 1);
+}
+
+static void
+set_layer_uniforms(void)
+{
+        int layer_parallax_uniform = glGetUniformLocation(map_program,
+                                                          "layer_parallax");
+        int layer_depth_uniform = glGetUniformLocation(map_program,
+                                                       "layer_depth");
+        float parallax[MAX_LAYERS];
+        float depth[MAX_LAYERS];
+
+        for (int i = 0; i < map_layers; ++i) {
+                parallax[i] = layers[i].parallax;
+                depth[i] = layer_depth(i);
+        }
+
+        glUseProgram(map_program);
+        glUniform1fv(layer_parallax_uniform, map_layers, parallax);
+        glUniform1fv(layer_depth_uniform, map_layers, depth);
+        glUseProgram(0);
+}
+
+static void
+init_map_cache(void)
+{
+        /* The caches are drawn to the screen with a quad covering the
+           viewport, like in texture mode. */
+        cache_program = load_shader_program("tilemap-vertex-shader.glsl",
+                                            "cache-fragment-shader.glsl");
+
+        glGenVertexArrays(1, &cache_vao);
+        glBindVertexArray(cache_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, map_vbo);
+
+        GLint index_attr = glGetAttribLocation(cache_program, "index");
+        glVertexAttribIPointer(index_attr, 1, GL_INT, 1 * sizeof(int),
+                               (void *) 0);
+        glEnableVertexAttribArray(index_attr);
 
         glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+
+        cache_size_uniform = glGetUniformLocation(cache_program,
+                                                  "cache_size");
+        cache_parallax_uniform = glGetUniformLocation(cache_program,
+                                                      "parallax");
+        cache_depth_uniform = glGetUniformLocation(cache_program, "depth");
+
+        /* The cache of the layer being drawn is bound to texture unit
+           5. */
+        glUseProgram(cache_program);
+        glUniform1i(glGetUniformLocation(cache_program, "cache"), 5);
+        glUseProgram(0);
+}
+
+static void
+init_map_overview(void)
+{
+        overview_program = load_shader_program("tilemap-vertex-shader.glsl",
+                                               "overview-fragment-shader.glsl");
+
+        glGenVertexArrays(1, &overview_vao);
+        glBindVertexArray(overview_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, map_vbo);
+
+        GLint index_attr = glGetAttribLocation(overview_program, "index");
+        glVertexAttribIPointer(index_attr, 1, GL_INT, 1 * sizeof(int),
+                               (void *) 0);
+        glEnableVertexAttribArray(index_attr);
 
-        glBindBuffer(GL_ARRAY_BUFFER, map_instance_vbo);
-        glBufferData(GL_ARRAY_BUFFER,
-                     map_size * 4 * sizeof(GLfloat),
-                     instance_data,
-                     GL_STATIC_DRAW);
         glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
 
-        glBindBuffer(GL_ARRAY_BUFFER, map_instance_vbo);
+        glUseProgram(overview_program);
+        glUniform1i(glGetUniformLocation(overview_program, "overview"), 6);
+        glUniform2f(glGetUniformLocation(overview_program, "map_size"),
+                    map_width, map_height);
+        glUniform1f(glGetUniformLocation(overview_program, "depth"),
+                    (DEPTH_BELOW_OBJECTS + 1.0f) / 2);
+        glUseProgram(0);
+}
 
-        GLint tex_coords_attr = glGetAttribLocation(map_program,
-                                                    "tile_texture_coords");
-        glEnableVertexAttribArray(tex_coords_attr);
-        glVertexAttribPointer(tex_coords_attr, 4, GL_FLOAT, GL_FALSE,
-                              4 * sizeof(float), (void *) 0);
+static void
+init_map(void)
+{
+        if (map_mode == MAP_MODE_TEXTURE)
+                map_program = load_shader_program(
+                        "tilemap-vertex-shader.glsl",
+                        "tilemap-fragment-shader.glsl");
+        else
+                map_program = load_shader_program("map-vertex-shader.glsl",
+                                                  "fragment-shader.glsl");
 
-        /* Mark it as an instance attribute updated for each
-           instance */
-        glVertexAttribDivisor(tex_coords_attr, 1);
+        /* Vertex data are actually only the vertex indices. 0, 1, 2,
+           and 3 being the bottom-left, top-left, top-right and
+           bottom-right corners of the quad. */
+        int vertex_data[] = {
+                0, 1, 3, /* triangle 1 */
+                1, 2, 3, /* triangle 2 */
+        };
+
+        init_world();
+
+        glGenVertexArrays(1, &map_vao);
+        glGenBuffers(1, &map_vbo);
+
+        glBindVertexArray(map_vao);
+
+        glBindBuffer(GL_ARRAY_BUFFER, map_vbo);
+        glBufferData(GL_ARRAY_BUFFER,
+                     sizeof(vertex_data),
+                     vertex_data,
+                     GL_STATIC_DRAW);
+
+        GLint index_attr = glGetAttribLocation(map_program, "index");
+        glVertexAttribIPointer(index_attr, 1, GL_INT, 1 * sizeof(int),
+                               (void *) 0);
+        glEnableVertexAttribArray(index_attr);
 
         glBindBuffer(GL_ARRAY_BUFFER, 0);
 
         glBindVertexArray(0);
 
-        free(instance_data);
+        if (map_mode == MAP_MODE_TEXTURE)
+                init_map_texture();
+        else
+                init_map_instances();
+
+        if (map_mode == MAP_MODE_CACHED)
+                init_map_cache();
+
+        if (overview_texture)
+                init_map_overview();
 
-        int map_width_uniform = glGetUniformLocation(map_program,
-                                                     "map_width");
         int camera_pos_uniform = glGetUniformLocation(map_program,
                                                       "camera_pos");
         int camera_size_uniform = glGetUniformLocation(map_program,
                                                        "camera_size");
+        int tile_table_uniform = glGetUniformLocation(map_program,
+                                                      "tile_table");
+        int tile_anims_uniform = glGetUniformLocation(map_program,
+                                                      "tile_anims");
+
+        set_layer_uniforms();
 
         glUseProgram(map_program);
-        glUniform1i(map_width_uniform, MAP_WIDTH);
+        glUniform1i(tile_table_uniform, 1);
+        glUniform1i(tile_anims_uniform, 4);
         glUniform2f(camera_pos_uniform, cam_x, cam_y);
         glUniform2f(camera_size_uniform, cam_w * zoom, cam_h * zoom);
         glUseProgram(0);
+
+        map_time_uniform = glGetUniformLocation(map_program, "time");
 }
 
 static void
 load(void)
 {
-        texture = load_texture("sheet.png");
+        texture = load_texture("sheet.png", &texture_w, &texture_h);
+        init_tile_table();
+        init_tile_anims();
+        init_sprite_colors();
+        init_autotiling();
 
         init_map();
         init_objects();
@@ -538,27 +4177,476 @@ load(void)
         /* Enable blending */
         glEnable(GL_BLEND);
         glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+        /* Enable depth testing, used to keep map layers and objects in
+           order. Things at the same depth are drawn in order. */
+        glEnable(GL_DEPTH_TEST);
+        glDepthFunc(GL_LEQUAL);
 }
 
 static void
-render(void)
+render_map_texture(void)
 {
-        glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+        int first, last;
+
+        glUseProgram(map_program);
+        glBindVertexArray(map_vao);
+
+        /* One quad for the layers below the objects and one for the
+           layers above them, each layers' tiles blended in the
+           fragment shader. */
+        for (int above = 0; above <= 1; ++above) {
+                first = -1;
+                last = -1;
+                for (int i = 0; i < map_layers; ++i) {
+                        if (!!(layers[i].flags & LAYER_ABOVE_OBJECTS) != above)
+                                continue;
+                        if (first < 0)
+                                first = i;
+                        last = i;
+                }
+
+                if (first < 0)
+                        continue;
+
+                glUniform2i(map_layer_range_uniform, first, last);
+                glUniform1f(map_depth_uniform, layer_depth(last));
+                glDrawArrays(GL_TRIANGLES, 0, 6);
+        }
+
+        glBindVertexArray(0);
+        glUseProgram(0);
+}
+
+/* Draw count layers of a chunk, starting from the given one. */
+static void
+draw_chunk(const struct chunk *chunk, int layer, int count)
+{
+        int layer_tiles = chunk->width * chunk->height;
+
+        /* There is no base instance in OpenGL 3.3, so point the
+           instance attribute at the first tile to draw instead. */
+        glVertexAttribIPointer(map_tile_attr, 1, GL_UNSIGNED_SHORT,
+                               sizeof(tile_t),
+                               (void *) ((chunk->slot * map_layers *
+                                          CHUNK_TILES +
+                                          layer * layer_tiles) *
+                                         sizeof(tile_t)));
+        glUniform2i(map_chunk_origin_uniform,
+                    chunk->cx * CHUNK_SIZE, chunk->cy * CHUNK_SIZE);
+        glUniform2i(map_chunk_size_uniform, chunk->width, chunk->height);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 6, count * layer_tiles);
+}
+
+static void
+render_map_instances(void)
+{
+        float x, y;
+        int cx0, cy0, cx1, cy1;
+        struct chunk *chunk;
+
+        glUseProgram(map_program);
+        glBindVertexArray(map_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, map_instance_vbo);
+
+        for (int layer = 0; layer < map_layers; ++layer) {
+                if (is_layer_cached(layer))
+                        continue;
+
+                /* Find the range of chunks intersecting the camera
+                   rectangle, as seen by this layer. */
+                x = cam_x * layers[layer].parallax;
+                y = cam_y * layers[layer].parallax;
+                cx0 = floorf(x / CHUNK_SIZE);
+                cy0 = floorf(y / CHUNK_SIZE);
+                cx1 = floorf((x + cam_w * zoom) / CHUNK_SIZE);
+                cy1 = floorf((y + cam_h * zoom) / CHUNK_SIZE);
+
+                if (cx0 < 0)
+                        cx0 = 0;
+                if (cy0 < 0)
+                        cy0 = 0;
+                if (cx1 >= chunks_w)
+                        cx1 = chunks_w - 1;
+                if (cy1 >= chunks_h)
+                        cy1 = chunks_h - 1;
+
+                for (int cy = cy0; cy <= cy1; ++cy) {
+                        for (int cx = cx0; cx <= cx1; ++cx) {
+                                chunk = find_chunk(cx, cy);
+                                if (!chunk || chunk->state != CHUNK_RESIDENT)
+                                        continue;
+
+                                /* In cached mode only the layers which
+                                   are not cached are drawn here, one
+                                   by one. */
+                                if (map_mode == MAP_MODE_CACHED) {
+                                        draw_chunk(chunk, layer, 1);
+                                        continue;
+                                }
+
+                                /* Otherwise all layers of the chunk
+                                   are drawn at once, so draw it only
+                                   the first time any of its layers is
+                                   visible. */
+                                if (chunk->last_drawn == frame_number)
+                                        continue;
+                                chunk->last_drawn = frame_number;
+                                draw_chunk(chunk, 0, map_layers);
+                        }
+                }
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+        glUseProgram(0);
+}
+
+/* Returns a mod b, for positive b, never negative. */
+static int
+floor_mod(int a, int b)
+{
+        return (a % b + b) % b;
+}
+
+/* Draw a rectangle of tiles of a layer into its cache. The rectangle
+   must not wrap around the cache edges. */
+static void
+bake_piece(int layer, int x0, int y0, int x1, int y1)
+{
+        int px0, py0, px1, py1;
+        int cx0, cy0, cx1, cy1;
+        struct chunk *chunk;
+
+        px0 = floor_mod(x0, cache_tiles_w);
+        py0 = floor_mod(y0, cache_tiles_h);
+        px1 = px0 + x1 - x0;
+        py1 = py0 + y1 - y0;
+
+        /* tiles to pixels */
+        px0 = px0 * cache_pixels_w / cache_tiles_w;
+        py0 = py0 * cache_pixels_h / cache_tiles_h;
+        px1 = px1 * cache_pixels_w / cache_tiles_w;
+        py1 = py1 * cache_pixels_h / cache_tiles_h;
+
+        glViewport(px0, py0, px1 - px0, py1 - py0);
+        glScissor(px0, py0, px1 - px0, py1 - py0);
         glClear(GL_COLOR_BUFFER_BIT);
 
-        /* render map */
+        glUniform2f(glGetUniformLocation(map_program, "camera_pos"), x0, y0);
+        glUniform2f(glGetUniformLocation(map_program, "camera_size"),
+                    x1 - x0, y1 - y0);
+
+        cx0 = x0 < 0 ? 0 : x0 / CHUNK_SIZE;
+        cy0 = y0 < 0 ? 0 : y0 / CHUNK_SIZE;
+        cx1 = x1 <= 0 ? -1 : (x1 - 1) / CHUNK_SIZE;
+        cy1 = y1 <= 0 ? -1 : (y1 - 1) / CHUNK_SIZE;
+        if (cx1 >= chunks_w)
+                cx1 = chunks_w - 1;
+        if (cy1 >= chunks_h)
+                cy1 = chunks_h - 1;
+
+        for (int cy = cy0; cy <= cy1; ++cy) {
+                for (int cx = cx0; cx <= cx1; ++cx) {
+                        chunk = find_chunk(cx, cy);
+                        if (chunk && chunk->state == CHUNK_RESIDENT)
+                                draw_chunk(chunk, layer, 1);
+                }
+        }
+}
+
+/* Draw a rectangle of tiles of a layer into its cache, split where it
+   wraps around the cache edges. */
+static void
+bake_rect(int layer, int x0, int y0, int x1, int y1)
+{
+        int xe, ye;
+
+        for (int y = y0; y < y1; y = ye) {
+                ye = y - floor_mod(y, cache_tiles_h) + cache_tiles_h;
+                if (ye > y1)
+                        ye = y1;
+
+                for (int x = x0; x < x1; x = xe) {
+                        xe = x - floor_mod(x, cache_tiles_w) + cache_tiles_w;
+                        if (xe > x1)
+                                xe = x1;
+
+                        bake_piece(layer, x, y, xe, ye);
+                }
+        }
+}
+
+/* (Re)create the cache textures for the current camera size. */
+static void
+resize_caches(void)
+{
+        struct layer_cache *cache;
+
+        cache_cam_w = cam_w * zoom;
+        cache_cam_h = cam_h * zoom;
+
+        /* The camera rectangle covers at most this many tiles, however
+           it is positioned. */
+        cache_tiles_w = (int) ceilf(cache_cam_w) + 1;
+        cache_tiles_h = (int) ceilf(cache_cam_h) + 1;
+        cache_pixels_w = ceilf(cache_tiles_w * view_w / cache_cam_w);
+        cache_pixels_h = ceilf(cache_tiles_h * view_h / cache_cam_h);
+
+        for (int i = 0; i < map_layers; ++i) {
+                if (!is_layer_cached(i))
+                        continue;
+
+                cache = &layer_caches[i];
+                if (!cache->texture) {
+                        glGenTextures(1, &cache->texture);
+                        glGenFramebuffers(1, &cache->fbo);
+                }
+
+                glBindTexture(GL_TEXTURE_2D, cache->texture);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8,
+                             cache_pixels_w, cache_pixels_h, 0,
+                             GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+                glBindFramebuffer(GL_FRAMEBUFFER, cache->fbo);
+                glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                                       GL_TEXTURE_2D, cache->texture, 0);
+                if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+                    GL_FRAMEBUFFER_COMPLETE)
+                {
+                        printf("Could not create map cache framebuffer.\n");
+                        exit(1);
+                }
+
+                /* Nothing in the cache yet. */
+                cache->x0 = cache->x1 = 0;
+                cache->y0 = cache->y1 = 0;
+                cache->dirty_x0 = cache->dirty_x1 = 0;
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glBindTexture(GL_TEXTURE_2D, texture);
+
+        glUseProgram(cache_program);
+        glUniform2f(cache_size_uniform, cache_tiles_w, cache_tiles_h);
+        glUseProgram(0);
+}
+
+/* Bring the caches up to date with the camera position and the map,
+   drawing the tiles coming into view and those invalidated. */
+static void
+update_caches(void)
+{
+        struct layer_cache *cache;
+        int x0, y0, x1, y1;
+        int ix0, iy0, ix1, iy1;
+        float ones[MAX_LAYERS];
+        int baked = 0;
+
+        if (cam_w * zoom != cache_cam_w || cam_h * zoom != cache_cam_h)
+                resize_caches();
+
         glUseProgram(map_program);
         glBindVertexArray(map_vao);
-        glDrawArraysInstanced(GL_TRIANGLES, 0, 6,
-                              MAP_WIDTH * MAP_HEIGHT);
+        glBindBuffer(GL_ARRAY_BUFFER, map_instance_vbo);
+
+        for (int layer = 0; layer < map_layers; ++layer) {
+                if (!is_layer_cached(layer))
+                        continue;
+
+                cache = &layer_caches[layer];
+
+                /* the tiles the camera rectangle touches */
+                x0 = floorf(cam_x * layers[layer].parallax);
+                y0 = floorf(cam_y * layers[layer].parallax);
+                x1 = floorf(cam_x * layers[layer].parallax + cache_cam_w) + 1;
+                y1 = floorf(cam_y * layers[layer].parallax + cache_cam_h) + 1;
+
+                ix0 = x0 > cache->x0 ? x0 : cache->x0;
+                iy0 = y0 > cache->y0 ? y0 : cache->y0;
+                ix1 = x1 < cache->x1 ? x1 : cache->x1;
+                iy1 = y1 < cache->y1 ? y1 : cache->y1;
+
+                if (x0 == cache->x0 && y0 == cache->y0 &&
+                    x1 == cache->x1 && y1 == cache->y1 &&
+                    cache->dirty_x0 >= cache->dirty_x1)
+                        continue;
+
+                if (!baked) {
+                        /* Tiles are drawn in the cache in map
+                           coordinates, without parallax, and replace
+                           whatever was there. */
+                        for (int i = 0; i < MAX_LAYERS; ++i)
+                                ones[i] = 1.0f;
+                        glUniform1fv(glGetUniformLocation(map_program,
+                                                          "layer_parallax"),
+                                     MAX_LAYERS, ones);
+                        glDisable(GL_BLEND);
+                        glDisable(GL_DEPTH_TEST);
+                        glEnable(GL_SCISSOR_TEST);
+                        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+                        baked = 1;
+                }
+
+                glBindFramebuffer(GL_FRAMEBUFFER, cache->fbo);
+
+                if (ix0 >= ix1 || iy0 >= iy1) {
+                        /* nothing in common with the previous
+                           rectangle */
+                        bake_rect(layer, x0, y0, x1, y1);
+                } else {
+                        /* Draw the parts of the new rectangle outside
+                           the previous one: the columns on the left
+                           and right, and the rows below and above the
+                           common part. */
+                        if (x0 < ix0)
+                                bake_rect(layer, x0, y0, ix0, y1);
+                        if (ix1 < x1)
+                                bake_rect(layer, ix1, y0, x1, y1);
+                        if (y0 < iy0)
+                                bake_rect(layer, ix0, y0, ix1, iy0);
+                        if (iy1 < y1)
+                                bake_rect(layer, ix0, iy1, ix1, y1);
+                }
+
+                cache->x0 = x0;
+                cache->y0 = y0;
+                cache->x1 = x1;
+                cache->y1 = y1;
+
+                /* Tiles invalidated outside the rectangle will be drawn
+                   anyway when they come into view. */
+                if (cache->dirty_x0 < cache->dirty_x1) {
+                        ix0 = x0 > cache->dirty_x0 ? x0 : cache->dirty_x0;
+                        iy0 = y0 > cache->dirty_y0 ? y0 : cache->dirty_y0;
+                        ix1 = x1 < cache->dirty_x1 ? x1 : cache->dirty_x1;
+                        iy1 = y1 < cache->dirty_y1 ? y1 : cache->dirty_y1;
+                        if (ix0 < ix1 && iy0 < iy1)
+                                bake_rect(layer, ix0, iy0, ix1, iy1);
+
+                        cache->dirty_x0 = cache->dirty_x1 = 0;
+                }
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+        glUseProgram(0);
+
+        if (!baked)
+                return;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, view_w, view_h);
+        glDisable(GL_SCISSOR_TEST);
+        glEnable(GL_DEPTH_TEST);
+        glEnable(GL_BLEND);
+
+        /* restore the uniforms changed for drawing the caches */
+        set_layer_uniforms();
+        update_camera();
+}
+
+static void
+render_map_overview(void)
+{
+        if (!overview_ready)
+                return;
+
+        if (overview_mips_dirty) {
+                glActiveTexture(GL_TEXTURE6);
+                glGenerateMipmap(GL_TEXTURE_2D);
+                glActiveTexture(GL_TEXTURE0);
+                overview_mips_dirty = 0;
+        }
+
+        glUseProgram(overview_program);
+        glBindVertexArray(overview_vao);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
+        glBindVertexArray(0);
+        glUseProgram(0);
+}
+
+static void
+render_map_cached(void)
+{
+        update_caches();
+
+        /* animated layers */
+        render_map_instances();
+
+        glUseProgram(cache_program);
+        glBindVertexArray(cache_vao);
+        glActiveTexture(GL_TEXTURE5);
+
+        for (int layer = 0; layer < map_layers; ++layer) {
+                if (!is_layer_cached(layer))
+                        continue;
 
+                glBindTexture(GL_TEXTURE_2D, layer_caches[layer].texture);
+                glUniform1f(cache_parallax_uniform, layers[layer].parallax);
+                glUniform1f(cache_depth_uniform, layer_depth(layer));
+                glDrawArrays(GL_TRIANGLES, 0, 6);
+        }
+
+        glActiveTexture(GL_TEXTURE0);
         glBindVertexArray(0);
         glUseProgram(0);
+}
+
+static void
+render(void)
+{
+        Uint32 time = SDL_GetTicks();
+
+        glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        /* render map */
+        glUseProgram(map_program);
+        glUniform1ui(map_time_uniform, time);
+
+        if (is_lod_view())
+                render_map_overview();
+        else if (map_mode == MAP_MODE_TEXTURE)
+                render_map_texture();
+        else if (map_mode == MAP_MODE_CACHED)
+                render_map_cached();
+        else
+                render_map_instances();
 
         /* render objects */
+        if (objects_dirty)
+                update_object_data();
+
         glUseProgram(object_program);
+        glUniform1ui(obj_time_uniform, time);
         glBindVertexArray(object_vao);
-        glDrawArraysInstanced(GL_TRIANGLES, 0, 6, 3);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 6, obj_opaque_count);
+
+        /* Translucent objects are blended in afterwards, back to front,
+           testing against the depth of everything else but not
+           writing their own. */
+        if (obj_draw_count > obj_opaque_count) {
+                glBindBuffer(GL_ARRAY_BUFFER, object_instance_vbo);
+                set_object_attributes(obj_ring_offset + obj_opaque_count *
+                                      sizeof(struct obj_instance));
+                glUniform1i(obj_translucent_uniform, 1);
+                glDepthMask(GL_FALSE);
+
+                glDrawArraysInstanced(GL_TRIANGLES, 0, 6,
+                                      obj_draw_count - obj_opaque_count);
+
+                glDepthMask(GL_TRUE);
+                glUniform1i(obj_translucent_uniform, 0);
+                set_object_attributes(obj_ring_offset);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+
+        fence_obj_region();
 
         glBindVertexArray(0);
         glUseProgram(0);
@@ -568,6 +4656,10 @@ static void
 handle_events(SDL_Event *e, SDL_Window *window, int *quit)
 {
         SDL_Event quitEvent;
+        int p = object_index(player);
+        int tint_count = sizeof(object_tints) / sizeof(object_tints[0]);
+        int picked;
+        int tile;
 
         switch (e->type) {
         case SDL_QUIT:
@@ -582,27 +4674,27 @@ handle_events(SDL_Event *e, SDL_Window *window, int *quit)
                         break;
 
                 case SDLK_LEFT:
-                        player->x -= cam_w / 100.0;
-                        update_object_data();
-                        center_camera(player->x, player->y);
+                        objects.x[p] -= cam_w / 100.0;
+                        touch_object(p);
+                        center_camera(objects.x[p], objects.y[p]);
                         break;
 
                 case SDLK_RIGHT:
-                        player->x += cam_w / 100.0;
-                        update_object_data();
-                        center_camera(player->x, player->y);
+                        objects.x[p] += cam_w / 100.0;
+                        touch_object(p);
+                        center_camera(objects.x[p], objects.y[p]);
                         break;
 
                 case SDLK_UP:
-                        player->y += cam_h / 100.0;
-                        update_object_data();
-                        center_camera(player->x, player->y);
+                        objects.y[p] += cam_h / 100.0;
+                        touch_object(p);
+                        center_camera(objects.x[p], objects.y[p]);
                         break;
 
                 case SDLK_DOWN:
-                        player->y -= cam_h / 100.0;
-                        update_object_data();
-                        center_camera(player->x, player->y);
+                        objects.y[p] -= cam_h / 100.0;
+                        touch_object(p);
+                        center_camera(objects.x[p], objects.y[p]);
                         break;
 
                 case SDLK_MINUS:
@@ -618,6 +4710,36 @@ handle_events(SDL_Event *e, SDL_Window *window, int *quit)
                                 zoom = 0.1;
                         update_camera();
                         break;
+
+                case SDLK_SPACE:
+                        /* Cycle through the sprites for the ground
+                           tile under the player. */
+                        tile = get_tile(objects.x[p],
+                                        objects.y[p], 0);
+                        if (tile >= 0)
+                                set_tile(objects.x[p],
+                                         objects.y[p], 0,
+                                         (tile + 1) % tile_count);
+                        break;
+
+                case SDLK_t:
+                        /* Paint the first terrain under the player. */
+                        if (autotile_count > 0)
+                                set_terrain(objects.x[p],
+                                            objects.y[p], 0, 0);
+                        break;
+
+                case SDLK_c:
+                        spawn_crowd(1000);
+                        break;
+
+                case SDLK_x:
+                        despawn_visible_objects();
+                        break;
+
+                case SDLK_a:
+                        animate_visible_objects();
+                        break;
                 }
 
         case SDL_WINDOWEVENT:
@@ -627,6 +4749,8 @@ handle_events(SDL_Event *e, SDL_Window *window, int *quit)
 
                         /* Update OpenGL viewport. */
                         glViewport(0, 0, winw, winh);
+                        view_w = winw;
+                        view_h = winh;
 
                         cam_w = winw / UNIT_SIZE;
                         cam_h = winh / UNIT_SIZE;
@@ -635,12 +4759,134 @@ handle_events(SDL_Event *e, SDL_Window *window, int *quit)
                         printf("Window resized: %dx%d\n", winw, winh);
                 }
                 break;
+
+        case SDL_MOUSEBUTTONDOWN:
+                if (e->button.button == SDL_BUTTON_LEFT) {
+                        /* Cycle through the tints of the object
+                           clicked. */
+                        picked = pick_object(e->button.x, e->button.y);
+                        if (picked >= 0) {
+                                objects.tint[picked] =
+                                        (objects.tint[picked] + 1) %
+                                        tint_count;
+                                touch_object(picked);
+                        }
+                } else if (e->button.button == SDL_BUTTON_RIGHT) {
+                        despawn_objects_around(e->button.x, e->button.y);
+                }
+                break;
+        }
+}
+
+static void
+usage(const char *program)
+{
+        printf("Usage: %s [--map-mode=instanced|texture|cached] [--stats]\n"
+               "          [--world=FILE | --world-size=WxH]\n"
+               "          [--chunk-memory=MB] [--objects=N]\n"
+               "          [--object-order=sort|depth] [--threads=N]\n",
+               program);
+        printf("\n");
+        printf("  --map-mode   how the map is rendered: one instance per\n");
+        printf("               visible tile (default), or a single quad\n");
+        printf("               looking up tiles from a texture, or\n");
+        printf("               instanced into off-screen caches of the\n");
+        printf("               layers not flagged as animated\n");
+        printf("  --stats      disable vsync and print average frame\n");
+        printf("               times periodically\n");
+        printf("  --world      world file to stream the map from\n");
+        printf("  --world-size size in tiles of the generated world when\n");
+        printf("               no world file is given (default: %dx%d)\n",
+               MAP_WIDTH, MAP_HEIGHT);
+        printf("  --chunk-memory\n");
+        printf("               memory cap for map chunks, in megabytes\n");
+        printf("               (default: %d)\n", DEFAULT_CHUNK_MEMORY);
+        printf("  --objects    number of extra objects to scatter over\n");
+        printf("               the map\n");
+        printf("  --object-order\n");
+        printf("               sort all objects by their base (default),\n");
+        printf("               or only the translucent ones and leave the\n");
+        printf("               rest to the depth buffer\n");
+        printf("  --threads    number of threads to split work among,\n");
+        printf("               including the main thread (default: one\n");
+        printf("               per core)\n");
+}
+
+static void
+parse_args(int argc, char *argv[])
+{
+        for (int i = 1; i < argc; ++i) {
+                if (strcmp(argv[i], "--map-mode=instanced") == 0) {
+                        map_mode = MAP_MODE_INSTANCED;
+                } else if (strcmp(argv[i], "--map-mode=texture") == 0) {
+                        map_mode = MAP_MODE_TEXTURE;
+                } else if (strcmp(argv[i], "--map-mode=cached") == 0) {
+                        map_mode = MAP_MODE_CACHED;
+                } else if (strcmp(argv[i], "--object-order=sort") == 0) {
+                        object_order = OBJECT_ORDER_SORT;
+                } else if (strcmp(argv[i], "--object-order=depth") == 0) {
+                        object_order = OBJECT_ORDER_DEPTH;
+                } else if (strcmp(argv[i], "--stats") == 0) {
+                        show_stats = 1;
+                } else if (strncmp(argv[i], "--world=", 8) == 0) {
+                        world_filename = argv[i] + 8;
+                } else if (sscanf(argv[i], "--world-size=%dx%d",
+                                  &map_width, &map_height) == 2 &&
+                           map_width > 0 && map_height > 0) {
+                        /* size of generated worlds */
+                } else if (sscanf(argv[i], "--chunk-memory=%d",
+                                  &chunk_memory) == 1 &&
+                           chunk_memory > 0) {
+                        /* megabytes */
+                } else if (sscanf(argv[i], "--objects=%d",
+                                  &crowd_size) == 1 &&
+                           crowd_size >= 0) {
+                        /* extra objects */
+                } else if (sscanf(argv[i], "--threads=%d",
+                                  &thread_count) == 1 &&
+                           thread_count > 0) {
+                        /* job threads */
+                } else {
+                        usage(argv[0]);
+                        exit(1);
+                }
+        }
+}
+
+static void
+update_stats(void)
+{
+        static Uint64 last_report;
+        static int frames;
+        static Uint64 objects_drawn;
+        Uint64 now = SDL_GetPerformanceCounter();
+        Uint64 freq = SDL_GetPerformanceFrequency();
+
+        if (last_report == 0)
+                last_report = now;
+
+        ++frames;
+        objects_drawn += obj_draw_count;
+        if (now - last_report >= STATS_INTERVAL * freq) {
+                printf("Average frame time: %.3f ms (%d frames)\n",
+                       1000.0 * (now - last_report) / freq / frames,
+                       frames);
+                printf("Average object upload: %.1f KB per frame\n",
+                       obj_upload_bytes / 1024.0 / frames);
+                printf("Average objects drawn: %.0f of %d\n",
+                       (double) objects_drawn / frames, obj_count);
+                last_report = now;
+                frames = 0;
+                obj_upload_bytes = 0;
+                objects_drawn = 0;
         }
 }
 
 int
 main(int argc, char *argv[])
 {
+        parse_args(argc, argv);
+
         if (SDL_Init(SDL_INIT_EVERYTHING) < 0) {
                 printf("SDL could not be initialized. SDL_Error: %s\n",
                        SDL_GetError());
@@ -651,6 +4897,7 @@ main(int argc, char *argv[])
         SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
         SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,
                             SDL_GL_CONTEXT_PROFILE_CORE);
+        SDL_GL_SetAttribute(SDL_GL_DEPTH_SIZE, 24);
 
         SDL_Window *window = SDL_CreateWindow(
                 "waterfall",
@@ -673,8 +4920,11 @@ main(int argc, char *argv[])
                 return 1;
         }
 
+        init_jobs(thread_count);
         load();
-        sort_objects();
+
+        if (show_stats)
+                SDL_GL_SetSwapInterval(0);
 
         SDL_ShowWindow(window);
 
@@ -682,14 +4932,27 @@ main(int argc, char *argv[])
 
         SDL_Event e;
         int quit = 0;
+        Uint32 last_ticks = SDL_GetTicks();
+        Uint32 now;
         while (!quit) {
                 if (SDL_PollEvent(&e))
                         handle_events(&e, window, &quit);
 
+                now = SDL_GetTicks();
+                update_objects((now - last_ticks) / 1000.0f);
+                last_ticks = now;
+
+                update_world();
                 render();
 
                 SDL_GL_SwapWindow(window);
+
+                if (show_stats)
+                        update_stats();
         }
 
+        quit_world();
+        quit_jobs();
+
         return 0;
 }
@@ -0,0 +1,82 @@
+#ifndef WFMAP_H
+#define WFMAP_H
+
+/* The .wfmap map format, shared between the engine and the map
+   compiler. All integers are little-endian.
+
+   A map file starts with a header:
+
+     offset  size  field
+          0     4  magic, "WFMP"
+          4     4  format version, WFMAP_VERSION
+          8     4  width of the map in tiles
+         12     4  height of the map in tiles
+         16     4  chunk size in tiles
+         20     4  number of layers
+         24     4  number of animations
+         28     4  number of autotile sets
+         32     8  offset of the chunk directory
+
+   followed by the layer table, the animation table and the autotile
+   table:
+
+     - each layer table entry is the parallax factor as a 32-bit float
+       and the layer flags (WFMAP_LAYER_*) as a 32-bit integer.
+
+     - each animation table entry is the animated sprite, the number of
+       frames, the frame duration in milliseconds and the sprite stride
+       between frames, all 32-bit integers.
+
+     - each autotile table entry is the first sprite of the set and the
+       number of neighbors (4 or 8) it depends on, both 32-bit
+       integers.
+
+   The chunk directory has an entry for every chunk of the map, in row
+   order, each consisting of the offset of the chunk payload in the
+   file (64 bits), its size in bytes and its encoding (WFMAP_ENCODING_*,
+   32 bits each). Chunks with a zero size are empty.
+
+   Raw chunk payloads start at multiples of WFMAP_PAGE_SIZE, so that
+   the file can be mapped in memory and the chunks used in place. A raw
+   payload contains the tiles of each layer of the chunk one after the
+   other, each layer row by row, 16 bits per tile; exactly the layout
+   of the tiles of a chunk in the map instance buffer. The top
+   WFMAP_TILE_LAYER_BITS bits of each tile are the index of its layer,
+   and the rest the sprite, WFMAP_TILE_NONE for empty tiles. Chunks on
+   the right and top edges of the map are smaller if the map size is
+   not a multiple of the chunk size. Tiles are expected to be
+   autotiled already.
+
+   Compressed payloads can start anywhere and decompress to a raw
+   payload:
+
+     - WFMAP_ENCODING_RLE payloads are a series of runs, each a 16-bit
+       count followed by the 16-bit tile repeated count times. Meant
+       for chunks made of a few uniform areas.
+
+     - WFMAP_ENCODING_LZ payloads are in the LZ4 block format (see
+       libs/wflz.h). */
+
+#define WFMAP_MAGIC "WFMP"
+#define WFMAP_VERSION 1
+
+#define WFMAP_HEADER_SIZE 40
+#define WFMAP_LAYER_SIZE 8
+#define WFMAP_ANIM_SIZE 16
+#define WFMAP_AUTOTILE_SIZE 8
+#define WFMAP_DIR_ENTRY_SIZE 16
+
+#define WFMAP_PAGE_SIZE 4096
+
+#define WFMAP_LAYER_ABOVE_OBJECTS 1
+#define WFMAP_LAYER_ANIMATED 2
+
+#define WFMAP_ENCODING_RAW 0
+#define WFMAP_ENCODING_RLE 1
+#define WFMAP_ENCODING_LZ 2
+
+#define WFMAP_TILE_LAYER_BITS 3
+#define WFMAP_TILE_SPRITE_BITS (16 - WFMAP_TILE_LAYER_BITS)
+#define WFMAP_TILE_NONE ((1 << WFMAP_TILE_SPRITE_BITS) - 1)
+
+#endif /* WFMAP_H */
@@ -0,0 +1,1523 @@
+/* wfmapc: compiles maps made with the Tiled map editor (TMX or JSON)
+   into the .wfmap format loaded by the engine (see wfmap.h), so that
+   all parsing and validation happens at build time.
+
+   Tilesets must use the sprite sheet with UNIT_SIZE x UNIT_SIZE tiles
+   and no margins or spacing, so that the tile IDs of a tileset are the
+   sprite numbers. Only orthogonal, finite maps with CSV or uncompressed
+   base64 layer data are supported.
+
+   Each tile layer becomes a map layer, bottom to top. Layers take
+   their parallax factor from the Tiled horizontal parallax factor, and
+   can be drawn above the objects with a boolean "above_objects"
+   property. Tile animations become sprite animations; their frames
+   must be evenly spaced in the sheet, starting from the animated tile,
+   and all of the same duration. Layers using animated tiles are
+   flagged as animated. A tile with an integer "autotile" property (4
+   or 8) starts an autotile set. Object layers are ignored.
+
+   Chunks are compressed with whichever of RLE and LZ gives the
+   smallest payload, unless that is no smaller than the raw tiles or
+   compression is turned off, in which case the engine can use them in
+   place. */
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb_image.h>
+
+#define WFLZ_IMPLEMENTATION
+#include <wflz.h>
+
+#include "wfmap.h"
+
+#define UNIT_SIZE 16
+#define CHUNK_SIZE 32
+#define MAX_LAYERS (1 << WFMAP_TILE_LAYER_BITS)
+#define MAX_TILESETS 64
+#define MAX_ANIMS 1024
+#define MAX_AUTOTILES 32
+
+/* Tiled stores flipping flags in the top bits of tile IDs. */
+#define GID_FLAGS 0xf0000000u
+
+struct tileset {
+        int firstgid;
+        int tilecount;
+};
+
+struct layer {
+        char name[64];
+        float parallax;
+        uint32_t flags;
+        uint16_t *sprites; /* width * height, rows top to bottom */
+};
+
+struct anim {
+        int sprite;
+        int frames;
+        int duration;
+        int stride;
+};
+
+struct autotile {
+        int base;
+        int neighbors;
+};
+
+static const char *map_filename;
+static char map_dir[1024];
+static const char *sheet_filename = "sheet.png";
+static int compress = 1;
+static int sheet_columns;
+static int sheet_sprites;
+
+static int map_width;
+static int map_height;
+static struct tileset tilesets[MAX_TILESETS];
+static int tileset_count;
+static struct layer layers[MAX_LAYERS];
+static int layer_count;
+static struct anim anims[MAX_ANIMS];
+static int anim_count;
+static struct autotile autotiles[MAX_AUTOTILES];
+static int autotile_count;
+
+static void
+fail(const char *format, ...)
+{
+        va_list ap;
+
+        printf("%s: ", map_filename);
+        va_start(ap, format);
+        vprintf(format, ap);
+        va_end(ap);
+        printf("\n");
+        exit(1);
+}
+
+static char *
+read_file(const char *filename)
+{
+        FILE *fp;
+        long length;
+        char *buffer;
+
+        fp = fopen(filename, "rb");
+        if (!fp) {
+                printf("Could not open file: %s\n", filename);
+                exit(1);
+        }
+
+        fseek(fp, 0, SEEK_END);
+        length = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+
+        buffer = malloc(length + 1);
+        if (fread(buffer, 1, length, fp) != length) {
+                printf("Could not read file: %s\n", filename);
+                exit(1);
+        }
+        buffer[length] = '\0';
+
+        fclose(fp);
+
+        return buffer;
+}
+
+static const char *
+base_name(const char *path)
+{
+        const char *slash = strrchr(path, '/');
+
+        return slash ? slash + 1 : path;
+}
+
+/* JSON */
+
+enum json_type {
+        JSON_NULL,
+        JSON_BOOL,
+        JSON_NUMBER,
+        JSON_STRING,
+        JSON_ARRAY,
+        JSON_OBJECT,
+};
+
+struct json {
+        enum json_type type;
+        double number;
+        char *string;
+        char *key;            /* for object members */
+        struct json *child;   /* first element or member */
+        struct json *next;
+};
+
+static const char *json_pos;
+
+static void
+json_skip_space(void)
+{
+        while (isspace((unsigned char) *json_pos))
+                ++json_pos;
+}
+
+static char *
+json_parse_string(void)
+{
+        char *result, *out;
+        const char *p;
+
+        /* The unescaped string is never longer than the escaped one. */
+        p = ++json_pos;
+        while (*p && *p != '"')
+                p += *p == '\\' && p[1] ? 2 : 1;
+        if (!*p)
+                fail("unterminated JSON string");
+
+        result = out = malloc(p - json_pos + 1);
+        while (*json_pos != '"') {
+                if (*json_pos != '\\') {
+                        *out++ = *json_pos++;
+                        continue;
+                }
+
+                ++json_pos;
+                switch (*json_pos++) {
+                case 'n': *out++ = '\n'; break;
+                case 't': *out++ = '\t'; break;
+                case 'r': *out++ = '\r'; break;
+                case 'b': *out++ = '\b'; break;
+                case 'f': *out++ = '\f'; break;
+                case 'u':
+                        /* Only needed for names; keep ASCII. */
+                        if (strlen(json_pos) < 4)
+                                fail("invalid JSON escape");
+                        *out++ = '?';
+                        json_pos += 4;
+                        break;
+                default: *out++ = json_pos[-1]; break;
+                }
+        }
+        *out = '\0';
+        ++json_pos;
+
+        return result;
+}
+
+static struct json *
+json_parse_value(void)
+{
+        struct json *value = calloc(1, sizeof(struct json));
+        struct json **tail;
+        char *end;
+
+        json_skip_space();
+        switch (*json_pos) {
+        case '{':
+        case '[':
+                value->type = *json_pos == '{' ? JSON_OBJECT : JSON_ARRAY;
+                ++json_pos;
+                tail = &value->child;
+                json_skip_space();
+                if (*json_pos == (value->type == JSON_OBJECT ? '}' : ']')) {
+                        ++json_pos;
+                        break;
+                }
+
+                for (;;) {
+                        char *key = NULL;
+
+                        if (value->type == JSON_OBJECT) {
+                                json_skip_space();
+                                if (*json_pos != '"')
+                                        fail("expected a JSON object key");
+                                key = json_parse_string();
+                                json_skip_space();
+                                if (*json_pos++ != ':')
+                                        fail("expected ':' in JSON object");
+                        }
+
+                        *tail = json_parse_value();
+                        (*tail)->key = key;
+                        tail = &(*tail)->next;
+
+                        json_skip_space();
+                        if (*json_pos == ',') {
+                                ++json_pos;
+                                continue;
+                        }
+                        if (*json_pos++ != (value->type == JSON_OBJECT ? '}' : ']'))
+                                fail("expected ',' or end of JSON %s",
+                                     value->type == JSON_OBJECT ? "object" : "array");
+                        break;
+                }
+                break;
+
+        case '"':
+                value->type = JSON_STRING;
+                value->string = json_parse_string();
+                break;
+
+        case 't':
+        case 'f':
+        case 'n':
+                if (strncmp(json_pos, "true", 4) == 0) {
+                        value->type = JSON_BOOL;
+                        value->number = 1;
+                        json_pos += 4;
+                } else if (strncmp(json_pos, "false", 5) == 0) {
+                        value->type = JSON_BOOL;
+                        json_pos += 5;
+                } else if (strncmp(json_pos, "null", 4) == 0) {
+                        json_pos += 4;
+                } else {
+                        fail("invalid JSON value");
+                }
+                break;
+
+        default:
+                value->type = JSON_NUMBER;
+                value->number = strtod(json_pos, &end);
+                if (end == json_pos)
+                        fail("invalid JSON value");
+                json_pos = end;
+                break;
+        }
+
+        return value;
+}
+
+static struct json *
+json_parse(const char *text)
+{
+        struct json *value;
+
+        json_pos = text;
+        value = json_parse_value();
+        json_skip_space();
+        if (*json_pos)
+                fail("trailing data after JSON value");
+
+        return value;
+}
+
+static struct json *
+json_get(const struct json *object, const char *key)
+{
+        if (!object || object->type != JSON_OBJECT)
+                return NULL;
+
+        for (struct json *member = object->child; member; member = member->next) {
+                if (strcmp(member->key, key) == 0)
+                        return member;
+        }
+
+        return NULL;
+}
+
+static double
+json_number(const struct json *object, const char *key, double default_value)
+{
+        struct json *member = json_get(object, key);
+
+        if (!member)
+                return default_value;
+        if (member->type != JSON_NUMBER && member->type != JSON_BOOL)
+                fail("\"%s\" is not a number", key);
+
+        return member->number;
+}
+
+static const char *
+json_string(const struct json *object, const char *key)
+{
+        struct json *member = json_get(object, key);
+
+        if (!member || member->type != JSON_STRING)
+                return NULL;
+
+        return member->string;
+}
+
+/* XML, only as much as TMX needs */
+
+struct xml_attr {
+        char *name;
+        char *value;
+        struct xml_attr *next;
+};
+
+struct xml {
+        char *name;
+        struct xml_attr *attrs;
+        char *text;           /* character data directly inside */
+        struct xml *child;
+        struct xml *next;
+};
+
+static const char *xml_pos;
+
+static void
+xml_skip_misc(void)
+{
+        for (;;) {
+                while (isspace((unsigned char) *xml_pos))
+                        ++xml_pos;
+
+                if (strncmp(xml_pos, "<?", 2) == 0) {
+                        xml_pos = strstr(xml_pos, "?>");
+                        if (!xml_pos)
+                                fail("unterminated XML declaration");
+                        xml_pos += 2;
+                } else if (strncmp(xml_pos, "<!--", 4) == 0) {
+                        xml_pos = strstr(xml_pos, "-->");
+                        if (!xml_pos)
+                                fail("unterminated XML comment");
+                        xml_pos += 3;
+                } else if (strncmp(xml_pos, "<!", 2) == 0) {
+                        xml_pos = strchr(xml_pos, '>');
+                        if (!xml_pos)
+                                fail("unterminated XML declaration");
+                        xml_pos += 1;
+                } else {
+                        return;
+                }
+        }
+}
+
+/* Copy n characters, replacing the predefined XML entities. */
+static char *
+xml_unescape(const char *s, size_t n)
+{
+        static const char *entities[][2] = {
+                { "&amp;", "&" },
+                { "&lt;", "<" },
+                { "&gt;", ">" },
+                { "&quot;", "\"" },
+                { "&apos;", "'" },
+        };
+        char *result = malloc(n + 1);
+        char *out = result;
+        const char *end = s + n;
+        size_t len;
+        int i;
+
+        while (s < end) {
+                if (*s == '&') {
+                        for (i = 0; i < 5; ++i) {
+                                len = strlen(entities[i][0]);
+                                if (end - s >= len &&
+                                    strncmp(s, entities[i][0], len) == 0)
+                                        break;
+                        }
+                        if (i < 5) {
+                                *out++ = entities[i][1][0];
+                                s += len;
+                                continue;
+                        }
+                }
+                *out++ = *s++;
+        }
+        *out = '\0';
+
+        return result;
+}
+
+static char *
+xml_parse_name(void)
+{
+        const char *start = xml_pos;
+
+        while (*xml_pos && (isalnum((unsigned char) *xml_pos) ||
+                            strchr("_-.:", *xml_pos)))
+                ++xml_pos;
+        if (xml_pos == start)
+                fail("expected an XML name");
+
+        return xml_unescape(start, xml_pos - start);
+}
+
+static struct xml *
+xml_parse_element(void)
+{
+        struct xml *element = calloc(1, sizeof(struct xml));
+        struct xml **child_tail = &element->child;
+        struct xml_attr **attr_tail = &element->attrs;
+        struct xml_attr *attr;
+        const char *text_start;
+        char quote;
+
+        if (*xml_pos++ != '<')
+                fail("expected an XML element");
+        element->name = xml_parse_name();
+
+        for (;;) {
+                while (isspace((unsigned char) *xml_pos))
+                        ++xml_pos;
+
+                if (strncmp(xml_pos, "/>", 2) == 0) {
+                        xml_pos += 2;
+                        return element;
+                }
+                if (*xml_pos == '>') {
+                        ++xml_pos;
+                        break;
+                }
+
+                attr = calloc(1, sizeof(struct xml_attr));
+                attr->name = xml_parse_name();
+                while (isspace((unsigned char) *xml_pos))
+                        ++xml_pos;
+                if (*xml_pos++ != '=')
+                        fail("expected '=' after XML attribute name");
+                while (isspace((unsigned char) *xml_pos))
+                        ++xml_pos;
+                quote = *xml_pos++;
+                if (quote != '"' && quote != '\'')
+                        fail("expected a quoted XML attribute value");
+                text_start = xml_pos;
+                while (*xml_pos && *xml_pos != quote)
+                        ++xml_pos;
+                if (!*xml_pos)
+                        fail("unterminated XML attribute value");
+                attr->value = xml_unescape(text_start, xml_pos - text_start);
+                ++xml_pos;
+
+                *attr_tail = attr;
+                attr_tail = &attr->next;
+        }
+
+        /* content */
+        for (;;) {
+                text_start = xml_pos;
+                while (*xml_pos && *xml_pos != '<')
+                        ++xml_pos;
+                if (!*xml_pos)
+                        fail("unterminated XML element: %s", element->name);
+                if (xml_pos > text_start && !element->text)
+                        element->text = xml_unescape(text_start,
+                                                     xml_pos - text_start);
+
+                if (strncmp(xml_pos, "</", 2) == 0) {
+                        xml_pos += 2;
+                        if (strncmp(xml_pos, element->name,
+                                    strlen(element->name)) != 0)
+                                fail("mismatched XML end tag for %s",
+                                     element->name);
+                        xml_pos = strchr(xml_pos, '>');
+                        if (!xml_pos)
+                                fail("unterminated XML end tag");
+                        ++xml_pos;
+                        return element;
+                }
+
+                if (strncmp(xml_pos, "<!--", 4) == 0 ||
+                    strncmp(xml_pos, "<?", 2) == 0) {
+                        xml_skip_misc();
+                        continue;
+                }
+
+                *child_tail = xml_parse_element();
+                child_tail = &(*child_tail)->next;
+        }
+}
+
+static struct xml *
+xml_parse(const char *text)
+{
+        struct xml *root;
+
+        xml_pos = text;
+        xml_skip_misc();
+        root = xml_parse_element();
+        xml_skip_misc();
+        if (*xml_pos)
+                fail("trailing data after XML document");
+
+        return root;
+}
+
+static const char *
+xml_attr(const struct xml *element, const char *name)
+{
+        for (struct xml_attr *attr = element->attrs; attr; attr = attr->next) {
+                if (strcmp(attr->name, name) == 0)
+                        return attr->value;
+        }
+
+        return NULL;
+}
+
+static double
+xml_number(const struct xml *element, const char *name, double default_value)
+{
+        const char *value = xml_attr(element, name);
+        char *end;
+        double result;
+
+        if (!value)
+                return default_value;
+
+        result = strtod(value, &end);
+        if (end == value || *end)
+                fail("attribute %s of <%s> is not a number", name,
+                     element->name);
+
+        return result;
+}
+
+static struct xml *
+xml_child(const struct xml *element, const char *name)
+{
+        for (struct xml *child = element->child; child; child = child->next) {
+                if (strcmp(child->name, name) == 0)
+                        return child;
+        }
+
+        return NULL;
+}
+
+/* Tile data */
+
+static int
+base64_value(char c)
+{
+        const char *digits =
+                "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        const char *p = c ? strchr(digits, c) : NULL;
+
+        return p ? p - digits : -1;
+}
+
+/* Decode the tile IDs of a layer, given as base64 encoded 32-bit
+   little-endian integers. */
+static void
+decode_base64_gids(const char *text, uint32_t *gids, int count)
+{
+        unsigned char bytes[4];
+        uint32_t bits = 0;
+        int nbits = 0;
+        int nbytes = 0;
+        int n = 0;
+        int v;
+
+        for (const char *p = text; *p && *p != '='; ++p) {
+                if (isspace((unsigned char) *p))
+                        continue;
+
+                v = base64_value(*p);
+                if (v < 0)
+                        fail("invalid base64 layer data");
+
+                bits = bits << 6 | v;
+                nbits += 6;
+                if (nbits < 8)
+                        continue;
+
+                nbits -= 8;
+                bytes[nbytes++] = bits >> nbits & 0xff;
+                if (nbytes < 4)
+                        continue;
+
+                if (n == count)
+                        fail("too much layer data");
+                gids[n++] = bytes[0] | bytes[1] << 8 | bytes[2] << 16 |
+                        (uint32_t) bytes[3] << 24;
+                nbytes = 0;
+        }
+
+        if (n != count)
+                fail("layer data has %d tiles, expected %d", n, count);
+}
+
+static void
+decode_csv_gids(const char *text, uint32_t *gids, int count)
+{
+        const char *p = text;
+        char *end;
+        int n = 0;
+
+        for (;;) {
+                while (isspace((unsigned char) *p) || *p == ',')
+                        ++p;
+                if (!*p)
+                        break;
+
+                if (n == count)
+                        fail("too much layer data");
+                gids[n++] = strtoul(p, &end, 10);
+                if (end == p)
+                        fail("invalid CSV layer data");
+                p = end;
+        }
+
+        if (n != count)
+                fail("layer data has %d tiles, expected %d", n, count);
+}
+
+static void
+check_encoding(const char *encoding, const char *compression)
+{
+        if (compression && *compression)
+                fail("compressed layer data is not supported; save the map "
+                     "with CSV or uncompressed base64 layer data");
+        if (encoding && strcmp(encoding, "csv") != 0 &&
+            strcmp(encoding, "base64") != 0)
+                fail("unsupported layer data encoding: %s", encoding);
+}
+
+/* Tilesets */
+
+static void
+check_tileset(const char *name, int tilewidth, int tileheight,
+              int columns, int margin, int spacing, const char *image)
+{
+        if (!image)
+                fail("tileset %s is an image collection; only the sprite "
+                     "sheet can be used", name);
+        if (strcmp(base_name(image), base_name(sheet_filename)) != 0)
+                fail("tileset %s uses %s instead of the sprite sheet %s",
+                     name, image, sheet_filename);
+        if (tilewidth != UNIT_SIZE || tileheight != UNIT_SIZE)
+                fail("tileset %s tiles are not %dx%d", name,
+                     UNIT_SIZE, UNIT_SIZE);
+        if (margin != 0 || spacing != 0)
+                fail("tileset %s has a margin or spacing", name);
+        if (columns != sheet_columns)
+                fail("tileset %s has %d columns, the sprite sheet %d",
+                     name, columns, sheet_columns);
+}
+
+static void
+add_tileset(int firstgid, int tilecount)
+{
+        if (tileset_count == MAX_TILESETS)
+                fail("too many tilesets");
+        if (firstgid < 1 || tilecount < 0 || tilecount > sheet_sprites)
+                fail("invalid tileset");
+
+        tilesets[tileset_count].firstgid = firstgid;
+        tilesets[tileset_count].tilecount = tilecount;
+        ++tileset_count;
+}
+
+/* Tiled animations are lists of (tile, duration) frames; they can only
+   be used if the frames are evenly spaced from the animated tile. */
+static void
+add_anim(int sprite, const int *frame_tiles, const int *durations, int frames)
+{
+        int stride;
+
+        if (frames < 1)
+                return;
+
+        stride = frames > 1 ? frame_tiles[1] - frame_tiles[0] : 0;
+        for (int i = 0; i < frames; ++i) {
+                if (frame_tiles[i] != sprite + i * stride ||
+                    durations[i] != durations[0])
+                        fail("animation of tile %d is not supported: frames "
+                             "must be evenly spaced from the tile and of "
+                             "equal duration", sprite);
+        }
+
+        if (stride < 0 || durations[0] < 1 || durations[0] > 0xffff ||
+            sprite + (frames - 1) * stride >= sheet_sprites)
+                fail("invalid animation of tile %d", sprite);
+        if (anim_count == MAX_ANIMS)
+                fail("too many animations");
+
+        anims[anim_count].sprite = sprite;
+        anims[anim_count].frames = frames;
+        anims[anim_count].duration = durations[0];
+        anims[anim_count].stride = stride;
+        ++anim_count;
+}
+
+static void
+add_autotile(int base, int neighbors)
+{
+        if (neighbors != 4 && neighbors != 8)
+                fail("autotile property of tile %d must be 4 or 8", base);
+        if (base + (neighbors == 8 ? 47 : 16) > sheet_sprites)
+                fail("autotile set of tile %d does not fit in the sheet",
+                     base);
+        if (autotile_count == MAX_AUTOTILES)
+                fail("too many autotile sets");
+
+        autotiles[autotile_count].base = base;
+        autotiles[autotile_count].neighbors = neighbors;
+        ++autotile_count;
+}
+
+static void
+json_tileset_tiles(const struct json *tileset)
+{
+        struct json *tiles = json_get(tileset, "tiles");
+        struct json *anim, *props;
+        int frame_tiles[256];
+        int durations[256];
+        int frames;
+        int id;
+
+        if (!tiles)
+                return;
+
+        for (struct json *tile = tiles->child; tile; tile = tile->next) {
+                id = json_number(tile, "id", 0);
+
+                anim = json_get(tile, "animation");
+                if (anim) {
+                        frames = 0;
+                        for (struct json *f = anim->child; f; f = f->next) {
+                                if (frames == 256)
+                                        fail("animation of tile %d too long", id);
+                                frame_tiles[frames] = json_number(f, "tileid", 0);
+                                durations[frames] = json_number(f, "duration", 0);
+                                ++frames;
+                        }
+                        add_anim(id, frame_tiles, durations, frames);
+                }
+
+                props = json_get(tile, "properties");
+                for (struct json *p = props ? props->child : NULL; p; p = p->next) {
+                        if (strcmp(json_string(p, "name") ? json_string(p, "name") : "",
+                                   "autotile") == 0)
+                                add_autotile(id, json_number(p, "value", 0));
+                }
+        }
+}
+
+static void
+xml_tileset_tiles(const struct xml *tileset)
+{
+        struct xml *anim, *props;
+        int frame_tiles[256];
+        int durations[256];
+        int frames;
+        int id;
+
+        for (struct xml *tile = tileset->child; tile; tile = tile->next) {
+                if (strcmp(tile->name, "tile") != 0)
+                        continue;
+
+                id = xml_number(tile, "id", 0);
+
+                anim = xml_child(tile, "animation");
+                if (anim) {
+                        frames = 0;
+                        for (struct xml *f = anim->child; f; f = f->next) {
+                                if (frames == 256)
+                                        fail("animation of tile %d too long", id);
+                                frame_tiles[frames] = xml_number(f, "tileid", 0);
+                                durations[frames] = xml_number(f, "duration", 0);
+                                ++frames;
+                        }
+                        add_anim(id, frame_tiles, durations, frames);
+                }
+
+                props = xml_child(tile, "properties");
+                for (struct xml *p = props ? props->child : NULL; p; p = p->next) {
+                        if (xml_attr(p, "name") &&
+                            strcmp(xml_attr(p, "name"), "autotile") == 0)
+                                add_autotile(id, xml_number(p, "value", 0));
+                }
+        }
+}
+
+static void
+json_tileset(const struct json *tileset, int firstgid)
+{
+        const char *name = json_string(tileset, "name");
+
+        name = name ? name : "(unnamed)";
+        check_tileset(name,
+                      json_number(tileset, "tilewidth", 0),
+                      json_number(tileset, "tileheight", 0),
+                      json_number(tileset, "columns", 0),
+                      json_number(tileset, "margin", 0),
+                      json_number(tileset, "spacing", 0),
+                      json_string(tileset, "image"));
+        add_tileset(firstgid, json_number(tileset, "tilecount", 0));
+        json_tileset_tiles(tileset);
+}
+
+static void
+xml_tileset(const struct xml *tileset, int firstgid)
+{
+        const char *name = xml_attr(tileset, "name");
+        struct xml *image = xml_child(tileset, "image");
+
+        name = name ? name : "(unnamed)";
+        check_tileset(name,
+                      xml_number(tileset, "tilewidth", 0),
+                      xml_number(tileset, "tileheight", 0),
+                      xml_number(tileset, "columns", 0),
+                      xml_number(tileset, "margin", 0),
+                      xml_number(tileset, "spacing", 0),
+                      image ? xml_attr(image, "source") : NULL);
+        add_tileset(firstgid, xml_number(tileset, "tilecount", 0));
+        xml_tileset_tiles(tileset);
+}
+
+/* External tilesets are looked up relative to the map, in either
+   format. */
+static void
+external_tileset(const char *source, int firstgid)
+{
+        char path[2048];
+        char *text;
+        const char *p;
+
+        snprintf(path, sizeof(path), "%s%s", source[0] == '/' ? "" : map_dir,
+                 source);
+        text = read_file(path);
+
+        p = text;
+        while (isspace((unsigned char) *p))
+                ++p;
+        if (*p == '<')
+                xml_tileset(xml_parse(text), firstgid);
+        else
+                json_tileset(json_parse(text), firstgid);
+}
+
+/* Layers */
+
+static uint16_t
+gid_sprite(uint32_t gid, int x, int y)
+{
+        int i;
+
+        if (gid == 0)
+                return WFMAP_TILE_NONE;
+        if (gid & GID_FLAGS)
+                fail("flipped or rotated tile at (%d, %d) is not supported",
+                     x, y);
+
+        /* the tileset with the largest first ID not above the tile's */
+        for (i = tileset_count - 1; i >= 0; --i) {
+                if (tilesets[i].firstgid <= gid)
+                        break;
+        }
+        if (i < 0 || gid - tilesets[i].firstgid >= tilesets[i].tilecount)
+                fail("tile at (%d, %d) is not in any tileset", x, y);
+
+        return gid - tilesets[i].firstgid;
+}
+
+static struct layer *
+add_layer(const char *name, int width, int height, float parallax,
+          int above_objects)
+{
+        struct layer *layer;
+
+        if (layer_count == MAX_LAYERS)
+                fail("more than %d tile layers", MAX_LAYERS);
+        if (width != map_width || height != map_height)
+                fail("layer %s is not the size of the map", name);
+
+        layer = &layers[layer_count++];
+        snprintf(layer->name, sizeof(layer->name), "%s", name);
+        layer->parallax = parallax;
+        layer->flags = above_objects ? WFMAP_LAYER_ABOVE_OBJECTS : 0;
+        layer->sprites = malloc(width * height * sizeof(uint16_t));
+
+        return layer;
+}
+
+static void
+set_layer_sprites(struct layer *layer, const uint32_t *gids)
+{
+        for (int i = 0; i < map_width * map_height; ++i)
+                layer->sprites[i] = gid_sprite(gids[i], i % map_width,
+                                               i / map_width);
+}
+
+static int
+json_bool_property(const struct json *object, const char *name)
+{
+        struct json *props = json_get(object, "properties");
+        const char *prop_name;
+
+        for (struct json *p = props ? props->child : NULL; p; p = p->next) {
+                prop_name = json_string(p, "name");
+                if (prop_name && strcmp(prop_name, name) == 0)
+                        return json_number(p, "value", 0) != 0;
+        }
+
+        return 0;
+}
+
+static int
+xml_bool_property(const struct xml *element, const char *name)
+{
+        struct xml *props = xml_child(element, "properties");
+        const char *value;
+
+        for (struct xml *p = props ? props->child : NULL; p; p = p->next) {
+                if (!xml_attr(p, "name") || strcmp(xml_attr(p, "name"), name) != 0)
+                        continue;
+
+                value = xml_attr(p, "value");
+                return value && strcmp(value, "true") == 0;
+        }
+
+        return 0;
+}
+
+static void
+warn_parallax(const char *name, double parallax_x, double parallax_y)
+{
+        if (parallax_x != parallax_y)
+                printf("%s: warning: layer %s has different horizontal and "
+                       "vertical parallax factors, using the horizontal one\n",
+                       map_filename, name);
+}
+
+static void
+json_layers(const struct json *list, double parallax)
+{
+        const char *type, *name;
+        struct json *data;
+        struct layer *layer;
+        uint32_t *gids;
+        double px;
+        int i;
+
+        for (struct json *l = list ? list->child : NULL; l; l = l->next) {
+                type = json_string(l, "type");
+                name = json_string(l, "name");
+                name = name ? name : "(unnamed)";
+                px = parallax * json_number(l, "parallaxx", 1);
+                warn_parallax(name, json_number(l, "parallaxx", 1),
+                              json_number(l, "parallaxy", 1));
+
+                if (type && strcmp(type, "group") == 0) {
+                        json_layers(json_get(l, "layers"), px);
+                        continue;
+                }
+                if (!type || strcmp(type, "tilelayer") != 0)
+                        continue;
+
+                layer = add_layer(name,
+                                  json_number(l, "width", 0),
+                                  json_number(l, "height", 0),
+                                  px,
+                                  json_bool_property(l, "above_objects"));
+
+                check_encoding(json_string(l, "encoding"),
+                               json_string(l, "compression"));
+                data = json_get(l, "data");
+                if (!data)
+                        fail("layer %s has no data", name);
+
+                gids = malloc(map_width * map_height * sizeof(uint32_t));
+                if (data->type == JSON_STRING) {
+                        decode_base64_gids(data->string, gids,
+                                           map_width * map_height);
+                } else {
+                        i = 0;
+                        for (struct json *g = data->child; g; g = g->next) {
+                                if (i == map_width * map_height)
+                                        fail("too much data in layer %s", name);
+                                gids[i++] = g->number;
+                        }
+                        if (i != map_width * map_height)
+                                fail("not enough data in layer %s", name);
+                }
+
+                set_layer_sprites(layer, gids);
+                free(gids);
+        }
+}
+
+static void
+xml_layers(const struct xml *parent, double parallax)
+{
+        const char *name;
+        struct xml *data;
+        struct layer *layer;
+        uint32_t *gids;
+        const char *encoding;
+        double px;
+
+        for (struct xml *l = parent->child; l; l = l->next) {
+                if (strcmp(l->name, "group") != 0 &&
+                    strcmp(l->name, "layer") != 0)
+                        continue;
+
+                name = xml_attr(l, "name");
+                name = name ? name : "(unnamed)";
+                px = parallax * xml_number(l, "parallaxx", 1);
+                warn_parallax(name, xml_number(l, "parallaxx", 1),
+                              xml_number(l, "parallaxy", 1));
+
+                if (strcmp(l->name, "group") == 0) {
+                        xml_layers(l, px);
+                        continue;
+                }
+
+                layer = add_layer(name,
+                                  xml_number(l, "width", 0),
+                                  xml_number(l, "height", 0),
+                                  px,
+                                  xml_bool_property(l, "above_objects"));
+
+                data = xml_child(l, "data");
+                if (!data)
+                        fail("layer %s has no data", name);
+
+                encoding = xml_attr(data, "encoding");
+                check_encoding(encoding, xml_attr(data, "compression"));
+                if (!encoding)
+                        fail("layer %s data is in XML tile elements; save the "
+                             "map with CSV or uncompressed base64 layer data",
+                             name);
+
+                gids = malloc(map_width * map_height * sizeof(uint32_t));
+                if (strcmp(encoding, "csv") == 0)
+                        decode_csv_gids(data->text ? data->text : "", gids,
+                                        map_width * map_height);
+                else
+                        decode_base64_gids(data->text ? data->text : "", gids,
+                                           map_width * map_height);
+
+                set_layer_sprites(layer, gids);
+                free(gids);
+        }
+}
+
+/* Maps */
+
+static void
+check_map(const char *orientation, int infinite, int tilewidth,
+          int tileheight)
+{
+        if (orientation && strcmp(orientation, "orthogonal") != 0)
+                fail("only orthogonal maps are supported");
+        if (infinite)
+                fail("infinite maps are not supported");
+        if (tilewidth != UNIT_SIZE || tileheight != UNIT_SIZE)
+                fail("map tiles are not %dx%d", UNIT_SIZE, UNIT_SIZE);
+        if (map_width < 1 || map_height < 1)
+                fail("invalid map size");
+}
+
+static int
+compare_tilesets(const void *a, const void *b)
+{
+        return ((const struct tileset *) a)->firstgid -
+                ((const struct tileset *) b)->firstgid;
+}
+
+/* Tile IDs are looked up in the tilesets in order of their first IDs,
+   so they are sorted before any layer is read. */
+static void
+sort_tilesets(void)
+{
+        qsort(tilesets, tileset_count, sizeof(struct tileset),
+              compare_tilesets);
+}
+
+static void
+load_json_map(const char *text)
+{
+        struct json *map = json_parse(text);
+        struct json *list;
+        const char *source;
+        int firstgid;
+
+        map_width = json_number(map, "width", 0);
+        map_height = json_number(map, "height", 0);
+        check_map(json_string(map, "orientation"),
+                  json_number(map, "infinite", 0),
+                  json_number(map, "tilewidth", 0),
+                  json_number(map, "tileheight", 0));
+
+        list = json_get(map, "tilesets");
+        for (struct json *t = list ? list->child : NULL; t; t = t->next) {
+                firstgid = json_number(t, "firstgid", 0);
+                source = json_string(t, "source");
+                if (source)
+                        external_tileset(source, firstgid);
+                else
+                        json_tileset(t, firstgid);
+        }
+        sort_tilesets();
+
+        json_layers(json_get(map, "layers"), 1);
+}
+
+static void
+load_xml_map(const char *text)
+{
+        struct xml *map = xml_parse(text);
+        const char *source;
+        int firstgid;
+
+        if (strcmp(map->name, "map") != 0)
+                fail("not a TMX map");
+
+        map_width = xml_number(map, "width", 0);
+        map_height = xml_number(map, "height", 0);
+        check_map(xml_attr(map, "orientation"),
+                  xml_number(map, "infinite", 0),
+                  xml_number(map, "tilewidth", 0),
+                  xml_number(map, "tileheight", 0));
+
+        for (struct xml *t = map->child; t; t = t->next) {
+                if (strcmp(t->name, "tileset") != 0)
+                        continue;
+
+                firstgid = xml_number(t, "firstgid", 0);
+                source = xml_attr(t, "source");
+                if (source)
+                        external_tileset(source, firstgid);
+                else
+                        xml_tileset(t, firstgid);
+        }
+        sort_tilesets();
+
+        xml_layers(map, 1);
+}
+
+/* Layers using animated sprites cannot be cached by the engine. */
+static void
+flag_animated_layers(void)
+{
+        unsigned char *animated = calloc(sheet_sprites, 1);
+
+        for (int i = 0; i < anim_count; ++i)
+                animated[anims[i].sprite] = 1;
+
+        for (int l = 0; l < layer_count; ++l) {
+                for (int i = 0; i < map_width * map_height; ++i) {
+                        if (layers[l].sprites[i] != WFMAP_TILE_NONE &&
+                            animated[layers[l].sprites[i]]) {
+                                layers[l].flags |= WFMAP_LAYER_ANIMATED;
+                                break;
+                        }
+                }
+        }
+
+        free(animated);
+}
+
+/* Output */
+
+static void
+put_le32(unsigned char *p, uint32_t value)
+{
+        p[0] = value;
+        p[1] = value >> 8;
+        p[2] = value >> 16;
+        p[3] = value >> 24;
+}
+
+static void
+put_le64(unsigned char *p, uint64_t value)
+{
+        put_le32(p, value);
+        put_le32(p + 4, value >> 32);
+}
+
+static void
+write_bytes(FILE *fp, const unsigned char *data, size_t size)
+{
+        if (fwrite(data, 1, size, fp) != size) {
+                printf("Could not write map file.\n");
+                exit(1);
+        }
+}
+
+static uint64_t
+page_align(uint64_t offset)
+{
+        return (offset + WFMAP_PAGE_SIZE - 1) / WFMAP_PAGE_SIZE * WFMAP_PAGE_SIZE;
+}
+
+/* Fill in the payload of a chunk, returning its size, or zero if all
+   its tiles are empty. The engine's y-axis points up, so rows are
+   stored bottom to top. */
+static size_t
+chunk_payload(int cx, int cy, unsigned char *payload)
+{
+        int width = map_width - cx * CHUNK_SIZE;
+        int height = map_height - cy * CHUNK_SIZE;
+        int empty = 1;
+        uint16_t sprite, tile;
+        unsigned char *p = payload;
+
+        width = width > CHUNK_SIZE ? CHUNK_SIZE : width;
+        height = height > CHUNK_SIZE ? CHUNK_SIZE : height;
+
+        for (int l = 0; l < layer_count; ++l) {
+                for (int y = cy * CHUNK_SIZE; y < cy * CHUNK_SIZE + height; ++y) {
+                        for (int x = cx * CHUNK_SIZE; x < cx * CHUNK_SIZE + width; ++x) {
+                                sprite = layers[l].sprites[(map_height - 1 - y) *
+                                                           map_width + x];
+                                if (sprite != WFMAP_TILE_NONE)
+                                        empty = 0;
+
+                                tile = l << WFMAP_TILE_SPRITE_BITS | sprite;
+                                *p++ = tile;
+                                *p++ = tile >> 8;
+                        }
+                }
+        }
+
+        return empty ? 0 : p - payload;
+}
+
+/* Run-length encode a raw payload into out, which must have room for
+   twice its size. */
+static size_t
+encode_rle(const unsigned char *payload, size_t size, unsigned char *out)
+{
+        unsigned char *p = out;
+        size_t run;
+
+        for (size_t i = 0; i < size; i += 2 * run) {
+                run = 1;
+                while (i + 2 * run < size && run < 0xffff &&
+                       memcmp(payload + i, payload + i + 2 * run, 2) == 0)
+                        ++run;
+
+                *p++ = run;
+                *p++ = run >> 8;
+                *p++ = payload[i];
+                *p++ = payload[i + 1];
+        }
+
+        return p - out;
+}
+
+/* Compress a raw payload into out, returning its encoding and setting
+   size to the size of the encoded payload, which is in out unless the
+   encoding is raw. out must have room for twice the raw size. */
+static int
+encode_payload(const unsigned char *payload, size_t *size, unsigned char *out)
+{
+        unsigned char *lz = out + *size;
+        size_t rle_size, lz_size;
+
+        if (!compress)
+                return WFMAP_ENCODING_RAW;
+
+        rle_size = encode_rle(payload, *size, out);
+        if (rle_size < *size) {
+                lz_size = wflz_compress(payload, *size, lz, rle_size);
+                if (lz_size == 0 || lz_size >= rle_size) {
+                        *size = rle_size;
+                        return WFMAP_ENCODING_RLE;
+                }
+        } else {
+                lz_size = wflz_compress(payload, *size, out, *size - 1);
+                if (lz_size == 0)
+                        return WFMAP_ENCODING_RAW;
+                lz = out;
+        }
+
+        memmove(out, lz, lz_size);
+        *size = lz_size;
+        return WFMAP_ENCODING_LZ;
+}
+
+static void
+write_map(const char *filename)
+{
+        int chunks_w = (map_width + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        int chunks_h = (map_height + CHUNK_SIZE - 1) / CHUNK_SIZE;
+        size_t tables_size;
+        uint64_t directory_offset, offset, end;
+        uint64_t raw_total = 0;
+        unsigned char *head, *p;
+        unsigned char *payload, *encoded;
+        size_t size;
+        int encoding;
+        FILE *fp;
+
+        tables_size = WFMAP_HEADER_SIZE +
+                layer_count * WFMAP_LAYER_SIZE +
+                anim_count * WFMAP_ANIM_SIZE +
+                autotile_count * WFMAP_AUTOTILE_SIZE;
+        directory_offset = tables_size;
+
+        head = calloc(1, tables_size + (size_t) chunks_w * chunks_h *
+                      WFMAP_DIR_ENTRY_SIZE);
+        payload = malloc(MAX_LAYERS * CHUNK_SIZE * CHUNK_SIZE * 2);
+        encoded = malloc(2 * MAX_LAYERS * CHUNK_SIZE * CHUNK_SIZE * 2);
+
+        memcpy(head, WFMAP_MAGIC, 4);
+        put_le32(head + 4, WFMAP_VERSION);
+        put_le32(head + 8, map_width);
+        put_le32(head + 12, map_height);
+        put_le32(head + 16, CHUNK_SIZE);
+        put_le32(head + 20, layer_count);
+        put_le32(head + 24, anim_count);
+        put_le32(head + 28, autotile_count);
+        put_le64(head + 32, directory_offset);
+
+        p = head + WFMAP_HEADER_SIZE;
+        for (int i = 0; i < layer_count; ++i, p += WFMAP_LAYER_SIZE) {
+                uint32_t parallax;
+
+                memcpy(&parallax, &layers[i].parallax, sizeof(float));
+                put_le32(p, parallax);
+                put_le32(p + 4, layers[i].flags);
+        }
+
+        for (int i = 0; i < anim_count; ++i, p += WFMAP_ANIM_SIZE) {
+                put_le32(p, anims[i].sprite);
+                put_le32(p + 4, anims[i].frames);
+                put_le32(p + 8, anims[i].duration);
+                put_le32(p + 12, anims[i].stride);
+        }
+
+        for (int i = 0; i < autotile_count; ++i, p += WFMAP_AUTOTILE_SIZE) {
+                put_le32(p, autotiles[i].base);
+                put_le32(p + 4, autotiles[i].neighbors);
+        }
+
+        fp = fopen(filename, "wb");
+        if (!fp) {
+                printf("Could not open file for writing: %s\n", filename);
+                exit(1);
+        }
+
+        /* Payloads go after the directory in the order of the
+           directory, raw ones each starting on a new page and
+           compressed ones packed together. */
+        end = directory_offset +
+                (uint64_t) chunks_w * chunks_h * WFMAP_DIR_ENTRY_SIZE;
+        for (int cy = 0; cy < chunks_h; ++cy) {
+                for (int cx = 0; cx < chunks_w; ++cx) {
+                        size = chunk_payload(cx, cy, payload);
+                        if (size == 0)
+                                continue;
+
+                        raw_total += size;
+                        encoding = encode_payload(payload, &size, encoded);
+                        offset = encoding == WFMAP_ENCODING_RAW ?
+                                page_align(end) : end;
+
+                        p = head + directory_offset +
+                                (cy * chunks_w + cx) * WFMAP_DIR_ENTRY_SIZE;
+                        put_le64(p, offset);
+                        put_le32(p + 8, size);
+                        put_le32(p + 12, encoding);
+
+                        fseek(fp, offset, SEEK_SET);
+                        write_bytes(fp, encoding == WFMAP_ENCODING_RAW ?
+                                    payload : encoded, size);
+                        end = offset + size;
+                }
+        }
+
+        fseek(fp, 0, SEEK_SET);
+        write_bytes(fp, head, directory_offset +
+                    (size_t) chunks_w * chunks_h * WFMAP_DIR_ENTRY_SIZE);
+
+        if (fclose(fp) != 0) {
+                printf("Could not write map file: %s\n", filename);
+                exit(1);
+        }
+
+        printf("%s: %llu bytes of tiles in %llu bytes\n", filename,
+               (unsigned long long) raw_total, (unsigned long long) end);
+
+        free(encoded);
+        free(payload);
+        free(head);
+}
+
+static void
+usage(const char *program)
+{
+        printf("Usage: %s [--sheet=FILE] [--raw] MAP OUTPUT\n", program);
+        printf("\n");
+        printf("Compile a Tiled map (TMX or JSON) into a .wfmap file.\n");
+        printf("\n");
+        printf("  --sheet      sprite sheet the tilesets must use\n");
+        printf("               (default: sheet.png)\n");
+        printf("  --raw        store chunks uncompressed\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+        const char *output = NULL;
+        const char *slash;
+        int sheet_w, sheet_h, channels;
+        char *text;
+        const char *p;
+
+        for (int i = 1; i < argc; ++i) {
+                if (strncmp(argv[i], "--sheet=", 8) == 0) {
+                        sheet_filename = argv[i] + 8;
+                } else if (strcmp(argv[i], "--raw") == 0) {
+                        compress = 0;
+                } else if (argv[i][0] == '-') {
+                        usage(argv[0]);
+                        return 1;
+                } else if (!map_filename) {
+                        map_filename = argv[i];
+                } else if (!output) {
+                        output = argv[i];
+                } else {
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+
+        if (!output) {
+                usage(argv[0]);
+                return 1;
+        }
+
+        if (!stbi_info(sheet_filename, &sheet_w, &sheet_h, &channels)) {
+                printf("Unable to read sprite sheet %s: %s\n",
+                       sheet_filename, stbi_failure_reason());
+                return 1;
+        }
+        sheet_columns = sheet_w / UNIT_SIZE;
+        sheet_sprites = sheet_columns * (sheet_h / UNIT_SIZE);
+        if (sheet_sprites > WFMAP_TILE_NONE) {
+                printf("Sprite sheet has more than %d sprites.\n",
+                       WFMAP_TILE_NONE);
+                return 1;
+        }
+
+        slash = strrchr(map_filename, '/');
+        if (slash)
+                snprintf(map_dir, sizeof(map_dir), "%.*s",
+                         (int) (slash - map_filename + 1), map_filename);
+
+        text = read_file(map_filename);
+        p = text;
+        while (isspace((unsigned char) *p))
+                ++p;
+        if (*p == '<')
+                load_xml_map(text);
+        else
+                load_json_map(text);
+
+        if (layer_count == 0)
+                fail("no tile layers");
+
+        flag_animated_layers();
+
+        write_map(output);
+
+        printf("%s: %dx%d tiles, %d layers, %d animations, %d autotile sets\n",
+               output, map_width, map_height, layer_count, anim_count,
+               autotile_count);
+
+        return 0;
+}